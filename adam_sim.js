@@ -0,0 +1,330 @@
+//-----------------------------------------------------------------------------
+//
+// File:        adam_sim.js
+//
+// Description: ADAM-6017 Modbus/TCP simulator
+//
+//              Emulates the input registers (function code 4) of the 8-channel
+//              ADAM-6017 ADC so cute_server.js can be run and tested without
+//              the real hardware.  Channel values may be scripted from a file
+//              or generated by a simple model of the cryostat, and responses
+//              may be delayed, jittered, dropped, fragmented or flooded to test
+//              the server's acquisition path and fault handling.
+//
+// Revisions:   2026-10-18 - v0.01 PH - created
+//
+// Syntax:      node adam_sim.js [OPTIONS]
+//
+//              --port NUM      - TCP port to listen on (default 5020)
+//              --latency MS    - response latency (default 5)
+//              --jitter MS     - maximum random extra latency (default 0)
+//              --drop FRAC     - fraction of requests to ignore (default 0)
+//              --exc FRAC      - fraction of requests to answer with a Modbus
+//                                "server device busy" exception (default 0)
+//              --frag          - split responses into random TCP fragments
+//              --flood RATE    - also send unsolicited responses with unknown
+//                                transaction IDs at RATE per second
+//              --script FILE   - read channel values from FILE (see below)
+//              --stats SECS    - print request statistics every SECS seconds
+//
+//              A script file contains lines of "TIME V0 V1 ... V7", where TIME
+//              is in seconds and V0-V7 are raw 16-bit channel values.  Values
+//              are interpolated between lines, and the script repeats after
+//              the last line.  Blank lines and lines starting with "#" are
+//              ignored.
+//
+// Notes:       Run the server with "node cute_server.js --adam localhost:5020"
+//              to use this simulator.
+//
+const kSimVersion       = 'v0.01';
+
+const kNumChan          = 8;        // number of ADAM-6017 input channels
+const kUnitID           = 1;        // Modbus unit ID that we answer to
+const kRegOffset        = 0x4000;   // (registers may also be addressed from 0x4000)
+const kNoiseCounts      = 20;       // peak-to-peak noise on modelled channels (ADC counts)
+
+// Modbus exception codes that we return
+const kExcFunction      = 1;        // illegal function
+const kExcAddress       = 2;        // illegal data address
+const kExcBusy          = 6;        // server device busy
+
+// model of the cryostat for generated channel values:
+// - dampers 0-2 and lab jacks 3-5 oscillate slowly about their nominal position
+// - channel 6 is the air pressure, and drifts slowly
+// - channel 7 is unused
+const kModel = [
+    // [ centre counts, amplitude counts, period seconds ]
+    [ 30000, 1500, 60 ],
+    [ 37600, 1000, 70 ],
+    [ 37600, 1000, 80 ],
+    [ 37600, 500, 90 ],
+    [ 37600, 500, 100 ],
+    [ 37600, 500, 110 ],
+    [ 49500, 300, 600 ],
+    [ 0, 0, 1 ]
+];
+
+var net = require('net');
+var fs = require('fs');
+
+var port = 5020;        // TCP port
+var latency = 5;        // response latency (ms)
+var jitter = 0;         // maximum extra random latency (ms)
+var dropFrac = 0;       // fraction of requests to drop
+var excFrac = 0;        // fraction of requests to answer with an exception
+var frag = 0;           // flag to fragment responses
+var floodRate = 0;      // rate of unsolicited responses (per second)
+var statsTime = 0;      // time between statistics printouts (s)
+var script;             // scripted channel values (array of [t,v0..v7])
+var startTime = Date.now();
+var clients = [];       // connected clients
+
+var stats = { req: 0, resp: 0, drop: 0, exc: 0, flood: 0 };
+
+//-----------------------------------------------------------------------------
+// Main script
+
+ParseArgs(process.argv.slice(2));
+
+var server = net.createServer(HandleConnection);
+server.on('error', function(err) {
+    Log('Server error:', err.message);
+    process.exit(1);
+});
+server.listen(port, function() {
+    Log('ADAM-6017 simulator', kSimVersion, 'listening on port', port);
+});
+
+if (floodRate) setInterval(Flood, 1000 / floodRate);
+if (statsTime) setInterval(PrintStats, statsTime * 1000);
+
+//-----------------------------------------------------------------------------
+// Parse command-line arguments
+function ParseArgs(args)
+{
+    for (var i=0; i<args.length; ++i) {
+        var val = args[i+1];
+        switch (args[i]) {
+            case '--port':    port = Number(val); ++i; break;
+            case '--latency': latency = Number(val); ++i; break;
+            case '--jitter':  jitter = Number(val); ++i; break;
+            case '--drop':    dropFrac = Number(val); ++i; break;
+            case '--exc':     excFrac = Number(val); ++i; break;
+            case '--flood':   floodRate = Number(val); ++i; break;
+            case '--stats':   statsTime = Number(val); ++i; break;
+            case '--frag':    frag = 1; break;
+            case '--script':  script = ReadScript(val); ++i; break;
+            default:
+                Log('Unknown option:', args[i]);
+                process.exit(1);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Read channel value script
+// Returns: array of [ t, v0, ... v7 ] entries sorted by time
+function ReadScript(file)
+{
+    var lines = fs.readFileSync(file, 'utf8').split('\n');
+    var rows = [];
+    for (var i=0; i<lines.length; ++i) {
+        var line = lines[i].trim();
+        if (!line.length || line.substr(0,1) == '#') continue;
+        var row = line.split(/\s+/).map(Number);
+        if (row.length != kNumChan + 1 || row.some(isNaN)) {
+            Log('Bad script line', i+1 + ':', line);
+            process.exit(1);
+        }
+        rows.push(row);
+    }
+    if (!rows.length) {
+        Log('Empty script', file);
+        process.exit(1);
+    }
+    rows.sort(function(a,b) { return a[0] - b[0] });
+    return rows;
+}
+
+//-----------------------------------------------------------------------------
+// Get the current raw value of a channel
+function ChannelValue(chan)
+{
+    var t = (Date.now() - startTime) / 1000;
+    var val;
+    if (script) {
+        // interpolate between script entries (repeating after the last entry)
+        var last = script[script.length-1];
+        if (last[0] > 0) t %= last[0];
+        for (var i=0; i<script.length-1; ++i) {
+            if (script[i+1][0] >= t) break;
+        }
+        var a = script[i], b = script[i+1];
+        if (!b || b[0] == a[0]) {
+            val = a[chan+1];
+        } else {
+            val = a[chan+1] + (t - a[0]) * (b[chan+1] - a[chan+1]) / (b[0] - a[0]);
+        }
+    } else {
+        var m = kModel[chan];
+        val = m[0] + m[1] * Math.sin(2 * Math.PI * t / m[2]);
+        if (m[1]) val += (Math.random() - 0.5) * kNoiseCounts;
+    }
+    val = Math.round(val);
+    return val < 0 ? 0 : (val > 0xffff ? 0xffff : val);
+}
+
+//-----------------------------------------------------------------------------
+// Handle a new client connection
+function HandleConnection(sock)
+{
+    var addr = sock.remoteAddress + ':' + sock.remotePort;
+    var buff = null;
+
+    Log('Client connected', addr);
+    clients.push(sock);
+
+    sock.on('data', function(data) {
+        buff = buff ? Buffer.concat([buff, data]) : data;
+        // split into Modbus/TCP frames using the MBAP header length
+        while (buff && buff.length >= 8) {
+            var len = buff.readUInt16BE(4);
+            if (buff.readUInt16BE(2) != 0 || len < 2 || len > 254) {
+                Log('Framing error from', addr);
+                buff = null;
+                break;
+            }
+            if (buff.length < len + 6) break;
+            HandleRequest(sock, buff.slice(0, len + 6));
+            buff = buff.slice(len + 6);
+        }
+    });
+    sock.on('close', function() {
+        Log('Client disconnected', addr);
+        var i = clients.indexOf(sock);
+        if (i >= 0) clients.splice(i, 1);
+    });
+    sock.on('error', function() { });
+}
+
+//-----------------------------------------------------------------------------
+// Handle a Modbus request frame
+function HandleRequest(sock, req)
+{
+    ++stats.req;
+    if (req[6] != kUnitID) return;      // (not for us)
+    if (Math.random() < dropFrac) {
+        ++stats.drop;
+        return;
+    }
+    var resp;
+    var func = req[7];
+    if (func != 4 || req.length < 12) {
+        resp = Exception(req, kExcFunction);
+    } else if (Math.random() < excFrac) {
+        resp = Exception(req, kExcBusy);
+    } else {
+        var addr = req.readUInt16BE(8);
+        var num = req.readUInt16BE(10);
+        if (addr >= kRegOffset) addr -= kRegOffset;
+        if (num < 1 || addr + num > kNumChan) {
+            resp = Exception(req, kExcAddress);
+        } else {
+            resp = Buffer.alloc(9 + num * 2);
+            req.copy(resp, 0, 0, 4);            // transaction and protocol ID
+            resp.writeUInt16BE(3 + num * 2, 4); // length
+            resp[6] = kUnitID;
+            resp[7] = func;
+            resp[8] = num * 2;                  // byte count
+            for (var i=0; i<num; ++i) {
+                resp.writeUInt16BE(ChannelValue(addr + i), 9 + i * 2);
+            }
+        }
+    }
+    var delay = latency + Math.random() * jitter;
+    setTimeout(function() { Send(sock, resp); }, delay);
+}
+
+//-----------------------------------------------------------------------------
+// Build a Modbus exception response
+function Exception(req, code)
+{
+    var resp = Buffer.alloc(9);
+    req.copy(resp, 0, 0, 4);
+    resp.writeUInt16BE(3, 4);
+    resp[6] = req[6];
+    resp[7] = req[7] | 0x80;
+    resp[8] = code;
+    ++stats.exc;
+    return resp;
+}
+
+//-----------------------------------------------------------------------------
+// Send a response, fragmenting it if requested
+function Send(sock, resp)
+{
+    if (sock.destroyed) return;
+    ++stats.resp;
+    if (!frag) {
+        sock.write(resp);
+        return;
+    }
+    // queue the response so fragments of different responses don't interleave
+    sock.outQueue = sock.outQueue ? Buffer.concat([sock.outQueue, resp]) : resp;
+    if (!sock.sending) SendFragment(sock);
+}
+
+//-----------------------------------------------------------------------------
+// Write a random-sized piece of the output queue
+// (on separate ticks so the pieces go in separate TCP segments)
+function SendFragment(sock)
+{
+    if (sock.destroyed || !sock.outQueue || !sock.outQueue.length) {
+        sock.sending = 0;
+        return;
+    }
+    var n = 1 + Math.floor(Math.random() * Math.min(sock.outQueue.length, 32));
+    sock.write(sock.outQueue.slice(0, n));
+    sock.outQueue = sock.outQueue.slice(n);
+    sock.sending = 1;
+    setTimeout(SendFragment, 1, sock);
+}
+
+//-----------------------------------------------------------------------------
+// Send an unsolicited response with a random transaction ID to all clients
+function Flood()
+{
+    for (var i=0; i<clients.length; ++i) {
+        var resp = Buffer.alloc(9 + kNumChan * 2);
+        resp.writeUInt16BE(Math.floor(Math.random() * 0x10000), 0);
+        resp.writeUInt16BE(3 + kNumChan * 2, 4);
+        resp[6] = kUnitID;
+        resp[7] = 4;
+        resp[8] = kNumChan * 2;
+        for (var j=0; j<kNumChan; ++j) {
+            resp.writeUInt16BE(ChannelValue(j), 9 + j * 2);
+        }
+        ++stats.flood;
+        Send(clients[i], resp);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Print request statistics since the last printout
+function PrintStats()
+{
+    Log('Requests:', stats.req, 'responses:', stats.resp, 'dropped:', stats.drop,
+        'exceptions:', stats.exc, 'flood:', stats.flood, '(' + statsTime + ' s)');
+    stats = { req: 0, resp: 0, drop: 0, exc: 0, flood: 0 };
+}
+
+//-----------------------------------------------------------------------------
+// Log a message with a timestamp
+function Log()
+{
+    var args = Array.prototype.slice.call(arguments);
+    console.log(new Date().toISOString() + ' ' + args.join(' '));
+}
+
+//-----------------------------------------------------------------------------
+// end
@@ -0,0 +1,297 @@
+//-----------------------------------------------------------------------------
+//
+// File:        avr_sim.js
+//
+// Description: Simulated EVK1101 AVR32 board for cute_server.js
+//
+//              Implements the text command protocol of cute_avr32.c for the
+//              commands used by the server ("ser", "ver", "wdt", "time", "nop",
+//              "halt", "pa#[-#]" and "m# stat/ramp/spd/stop/halt/on/pos/dir/
+//              acc/hb"), with a virtual motor model and limit switches, so the
+//              server can be run without hardware.
+//
+// Revisions:   2026-10-18 - v0.01 PH - created
+//
+// Syntax:      (module) var sim = new (require('./avr_sim.js').SimAVR)(sn, opts, onData);
+//
+//              sn     - serial number returned by the "ser" command
+//              opts   - options: latency = response latency (ms, default 2),
+//                       travel = distance to the limit switches from position 0
+//                       (steps, default 21333)
+//              onData - called with "this" set to the simulated AVR and the
+//                       response data as a Buffer (like a USB 'data' event)
+//
+//              sim.SendCmd(cmd)  - send command string to the simulated AVR
+//              sim.SetAvrNum(n)  - set the AVR number (sim.avrNum)
+//              sim.Release()     - stop communicating with the simulated AVR
+//              sim.Close()       - (same as Release)
+//
+//              These are the same member functions that cute_server.js adds
+//              to its USB devices, so a SimAVR may be used in their place.
+//
+const kSimVersion       = '1.29';   // firmware version that we emulate
+const kNumMotors        = 3;
+const kNumPins          = 64;       // number of PA/PB channels (PB0 = 32)
+const kMinSpeed         = 30;       // slowest motor speed (steps/s)
+const kMotorAccDefault  = 4000;     // default motor acceleration (steps/s/s)
+const kDefaultLatency   = 2;        // default response latency (ms)
+const kDefaultTravel    = 21333;    // default distance to limit switches (steps, 5 mm)
+
+//-----------------------------------------------------------------------------
+// Simulated stepper motor
+function SimMotor()
+{
+    this.pos = 0;       // position (steps, fractional)
+    this.spd = 0;       // current velocity (steps/s, +ve = dir 0)
+    this.target = 0;    // velocity we are ramping to (steps/s)
+    this.acc = kMotorAccDefault;
+    this.dir = 0;       // direction flag
+    this.on = 0;        // windings on flag (motor only runs when on)
+    this.hb = 0;        // heartbeat timeout (ms, 0 = none)
+    this.lastCmd = 0;   // time of last command for this motor (ms)
+    this.time = Date.now();
+}
+
+//-----------------------------------------------------------------------------
+// Advance the motor model to the specified time
+SimMotor.prototype.Update = function(now)
+{
+    // ramp down from the time that the heartbeat timed out
+    var hbTime = this.lastCmd + this.hb;
+    if (this.hb && this.target && this.time < hbTime && now > hbTime) {
+        this.Update(hbTime);
+        this.target = 0;
+    }
+    var dt = (now - this.time) / 1000;
+    this.time = now;
+    if (dt <= 0) return;
+    // accelerate toward the target velocity, then continue at constant velocity
+    var dv = this.target - this.spd;
+    var acc = dv < 0 ? -this.acc : this.acc;
+    var tr = Math.min(dt, dv / acc);
+    this.pos += (this.spd + acc * tr / 2) * tr;
+    this.spd += acc * tr;
+    if (tr == dv / acc) this.spd = this.target;
+    this.pos += this.spd * (dt - tr);
+    // stop when we ramp down below the minimum speed
+    if (!this.target && Math.abs(this.spd) < kMinSpeed) this.spd = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Simulated AVR board
+function SimAVR(sn, opts, onData)
+{
+    opts = opts || { };
+    this.avrSN = sn;
+    this.latency = opts.latency == null ? kDefaultLatency : opts.latency;
+    this.travel = opts.travel || kDefaultTravel;
+    this.onData = onData;
+    this.closed = 0;
+    this.start = Date.now();
+    this.wdt = 0;
+    this.motors = [];
+    for (var i=0; i<kNumMotors; ++i) this.motors.push(new SimMotor());
+    this.pins = [];     // output pin values (or null for inputs)
+    this.pullUp = [];   // flags for inputs with pull-ups
+}
+
+//-----------------------------------------------------------------------------
+// Send a command string to the simulated AVR
+// (responses are returned after the latency through the onData callback)
+SimAVR.prototype.SendCmd = function(str)
+{
+    if (this.closed) return;
+    var out = [];
+    var cmds = str.split(/[\n;]/);
+    for (var i=0; i<cmds.length; ++i) {
+        var cmd = cmds[i].trim();
+        if (!cmd.length) continue;
+        var idx = '';
+        if (cmd.length > 1 && cmd.substr(1,1) == '.') {
+            idx = cmd.substr(0,2);
+            cmd = cmd.substr(2);
+        }
+        var resp = this.Command(cmd.split(/\s+/));
+        if (resp.err) {
+            out.push(idx + 'BAD ' + resp.err);
+        } else {
+            out.push(idx + 'OK' + (resp.msg ? ' ' + resp.msg : ''));
+        }
+    }
+    if (!out.length) return;
+    var self = this;
+    var data = Buffer.from(out.join('\n') + '\n\0');
+    setTimeout(function() {
+        if (!self.closed) self.onData.call(self, data);
+    }, this.latency);
+}
+
+//-----------------------------------------------------------------------------
+// Set our AVR number
+SimAVR.prototype.SetAvrNum = function(n)
+{
+    this.avrNum = n;
+}
+
+//-----------------------------------------------------------------------------
+// Stop communicating with the simulated AVR
+SimAVR.prototype.Release = function()
+{
+    this.closed = 1;
+}
+
+SimAVR.prototype.Close = SimAVR.prototype.Release;
+
+//-----------------------------------------------------------------------------
+// Get the firmware timestamp string (" T=SEC")
+SimAVR.prototype.Time = function()
+{
+    return ' T=' + ((Date.now() - this.start) / 1000).toFixed(6);
+}
+
+//-----------------------------------------------------------------------------
+// Get the value of a PA/PB input channel
+SimAVR.prototype.Pin = function(n)
+{
+    if (this.pins[n] != null) return this.pins[n];
+    // PA0-PA5 are the active-low top/bottom limit switches of motors 0-2
+    if (n < kNumMotors * 2) {
+        var pos = this.motors[n >> 1].pos;
+        var hit = (n & 0x01) ? (pos <= -this.travel) : (pos >= this.travel);
+        if (hit) return 0;
+    }
+    return this.pullUp[n] ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Execute a command
+// Inputs: args=command and arguments
+// Returns: object with "msg" response, or "err" if the command failed
+SimAVR.prototype.Command = function(args)
+{
+    var now = Date.now();
+    var cmd = args[0];
+    var i;
+
+    for (i=0; i<kNumMotors; ++i) this.motors[i].Update(now);
+
+    if (/^m\d$/.test(cmd) && Number(cmd.substr(1)) < kNumMotors) {
+        var n = Number(cmd.substr(1));
+        var mot = this.motors[n];
+        var sub = args[1] || 'stat';
+        var dat = args[2];
+        mot.lastCmd = now;
+        switch (sub) {
+            case 'stat':
+                var spd = Math.round(Math.abs(mot.spd));
+                var dir = mot.dir ? '-' : '+';
+                return { msg: cmd + ' SPD=' + dir + spd + ' POS=' + Math.round(mot.pos) +
+                              ' CLK=4' + this.Time() };
+            case 'ramp':
+            case 'spd':
+                if (dat == null) return { err: 'no speed' };
+                var val = Number(dat);
+                if (isNaN(val)) return { err: 'invalid speed' };
+                if (val > 0 && !mot.on) return { err: cmd + ' is not on' };
+                mot.target = val > 0 ? (mot.dir ? -val : val) : 0;
+                if (sub == 'spd') {
+                    mot.spd = mot.target;
+                    return { msg: cmd + ' SPD=' + (val > 0 ? val : 0) };
+                }
+                return { msg: cmd + ' RAMP=' + Math.round(val > 0 ? val : 0) };
+            case 'stop':
+                mot.target = 0;
+                return { msg: cmd + ' RAMP=0' };
+            case 'halt':
+                mot.target = mot.spd = 0;
+                return { msg: cmd + ' HALTED' };
+            case 'on':
+            case 'dir':
+                if (dat != null) {
+                    if (dat == '0' || dat == '1') {
+                        if (sub == 'on') {
+                            mot.on = Number(dat);
+                            if (!mot.on) mot.target = mot.spd = 0;
+                        } else {
+                            if (mot.spd) return { err: 'motor is running' };
+                            mot.dir = Number(dat);
+                        }
+                    } else if (dat != '+' && dat != '-') {
+                        return { err: 'must set to 0, 1, + or -' };
+                    }
+                    return { msg: '' };
+                }
+                return { msg: cmd + ' VAL=' + (sub == 'on' ? mot.on : mot.dir) };
+            case 'pos':
+                if (dat != null) {
+                    if (isNaN(Number(dat))) return { err: 'invalid position' };
+                    mot.pos = Number(dat);
+                }
+                return { msg: cmd + ' POS=' + Math.round(mot.pos) };
+            case 'acc':
+                if (dat != null) {
+                    if (!(Number(dat) > 0)) return { err: 'invalid acceleration' };
+                    mot.acc = Number(dat);
+                }
+                return { msg: cmd + ' ACC=' + mot.acc };
+            case 'hb':
+                if (dat != null) mot.hb = Number(dat) || 0;
+                return { msg: cmd + ' HB=' + mot.hb };
+            default:
+                return { err: 'unknown cmd' };
+        }
+    }
+
+    var m = /^p([ab])(\d+)(?:-(\d+))?$/.exec(cmd);
+    if (m) {
+        var ofs = m[1] == 'b' ? 32 : 0;
+        var n1 = Number(m[2]) + ofs;
+        var n2 = m[3] == null ? n1 : Number(m[3]) + ofs;
+        if (n1 >= kNumPins || n2 >= kNumPins) return { err: 'channel out of range' };
+        var step = n2 >= n1 ? 1 : -1;
+        if (args[1] != null) {
+            // set outputs or pull-ups ("0", "1", "-" or "+" for each channel)
+            for (i=0; ; i+=step) {
+                var ch = args[1].substr(Math.min(Math.abs(i), args[1].length - 1), 1);
+                var pin = n1 + i;
+                switch (ch) {
+                    case '0': case '1': this.pins[pin] = Number(ch); break;
+                    case '+': this.pins[pin] = null; this.pullUp[pin] = 1; break;
+                    case '-': this.pins[pin] = null; this.pullUp[pin] = 0; break;
+                    default: return { err: 'must set to 0, 1, - or +' };
+                }
+                if (pin == n2) break;
+            }
+            return { msg: '' };
+        }
+        var val = '';
+        for (i=n1; ; i+=step) {
+            val += this.Pin(i);
+            if (i == n2) break;
+        }
+        return { msg: cmd + ' VAL=' + val + this.Time() };
+    }
+
+    switch (cmd) {
+        case 'ser':
+            return { msg: this.avrSN };
+        case 'ver':
+            return { msg: 'Version ' + kSimVersion + ' (CUTE)' };
+        case 'wdt':
+            if (args[1] != null) this.wdt = Number(args[1]) || 0;
+            return { msg: this.wdt ? 'WDT set to ' + this.wdt + ' seconds' : 'WDT disabled' };
+        case 'time':
+            return { msg: 'time' + this.Time() };
+        case 'halt':
+            for (i=0; i<kNumMotors; ++i) this.motors[i].target = this.motors[i].spd = 0;
+            return { msg: 'HALTED' };
+        case 'nop':
+            return { msg: '' };
+    }
+    return { err: 'unknown cmd' };
+}
+
+module.exports = { SimAVR: SimAVR };
+
+//-----------------------------------------------------------------------------
+// end
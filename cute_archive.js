@@ -0,0 +1,392 @@
+//-----------------------------------------------------------------------------
+//
+// File:        cute_archive.js
+//
+// Description: Binary time-series archive of CUTE cryostat readings
+//
+//              cute_server.js uses this module to append one fixed-size record
+//              for every hardware poll to a daily archive file, along with a
+//              time index that is updated once a minute.  The records are
+//              buffered and written in batches.
+//
+//              Run from the command line, this prints the records in a time
+//              range as text for post-mortem analysis.
+//
+// Revisions:   2026-10-18 - v0.01 PH - created
+//
+// Syntax:      node cute_archive.js FILE [START [END]]
+//
+//              FILE  - archive file (eg. "cute_20261018.dat")
+//              START - start time (anything Date() understands, or ms since epoch)
+//              END   - end time (default is the end of the file)
+//
+//              (module) var archive = new (require('./cute_archive.js').Archive)(prefix);
+//
+//              archive.Add(time, flags, limits, raw, cal, pos, weight, motorPos, motorSpd)
+//              archive.Close()
+//              require('./cute_archive.js').Read(file, t0, t1, onRecord, onDone)
+//
+// Notes:       Archive files are named PREFIX + "YYYYMMDD.dat", and each has
+//              a matching ".idx" index file.  Records are kRecLen bytes,
+//              little-endian, with this layout:
+//
+//               0  Float64      time (ms since 1970)
+//               8  Uint8        record version (kRecVersion)
+//               9  Uint8        flags (see kFlagXxx constants)
+//              10  Uint8        limit switches (bit N = PA N, 1 = open)
+//              11  Uint8        (reserved)
+//              12  Uint16 x 8   raw Adam ADC values
+//              28  Float32 x 7  calibrated Adam values
+//              56  Float32 x 3  damper positions (mm)
+//              68  Float32 x 3  weights to add to dampers (kg)
+//              80  Int32 x 3    motor positions (steps)
+//              92  Float32 x 3  motor speeds (steps/s)
+//
+//              Index entries are kIdxLen bytes: Float64 time of the first
+//              record in a minute, and Float64 record number in the file.
+//
+//              At the 40 ms minimum poll time the archive grows by about
+//              220 MB/day.  There is no retention policy, so old files must
+//              be removed (or compressed) by hand.
+//
+const kRecLen       = 104;      // archive record length (bytes)
+const kRecVersion   = 1;        // archive record version
+const kIdxLen       = 16;       // index entry length (bytes)
+const kIndexTime    = 60000;    // time between index entries (ms)
+const kBatchRecs    = 256;      // maximum number of records to buffer before writing
+const kFlushTime    = 2000;     // maximum time to buffer records before writing (ms)
+
+const kFlagAdam     = 0x01;     // Adam values are valid
+const kFlagAVR0     = 0x02;     // motor positions, speeds and limit switches are valid
+const kFlagActive   = 0x04;     // position control was active
+
+var fs = require('fs');
+
+//-----------------------------------------------------------------------------
+// Main script (when run from the command line)
+
+if (require.main === module) {
+    var args = process.argv.slice(2);
+    if (!args.length) {
+        console.log('Syntax: node cute_archive.js FILE [START [END]]');
+        process.exit(1);
+    }
+    Read(args[0], ParseTime(args[1], 0), ParseTime(args[2], Infinity), PrintRecord,
+        function(error) {
+            if (error) {
+                console.log('Error reading', args[0] + ':', error.message);
+                process.exit(1);
+            }
+        }
+    );
+}
+
+//-----------------------------------------------------------------------------
+// Archive writer
+// Inputs: prefix=file name prefix (may include a directory)
+function Archive(prefix)
+{
+    this.prefix = prefix || '';
+    this.day = '';          // date of the current archive file (YYYYMMDD)
+    this.fd = null;         // archive file descriptor
+    this.idxFd = null;      // index file descriptor
+    this.datPos = 0;        // file position for the next records
+    this.idxPos = 0;        // file position for the next index entries
+    this.recNum = 0;        // number of records in the archive file
+    this.idxTime = 0;       // time of the next index entry (ms)
+    this.buff = Buffer.alloc(kBatchRecs * kRecLen);
+    this.num = 0;           // number of records in the buffer
+    this.idx = [];          // index entries waiting to be written
+    this.queue = [];        // queued file operations
+    this.writing = null;    // asynchronous write in progress (or null)
+    this.closed = 0;
+    this.flushTimer = null;
+}
+
+//-----------------------------------------------------------------------------
+// Add a record to the archive
+// Inputs: time=record time (ms), flags=kFlagXxx flags, limits=limit switch
+//         values (array), raw=raw Adam values, cal=calibrated Adam values,
+//         pos=damper positions, weight=add weights, motorPos=motor positions,
+//         motorSpd=motor speeds
+Archive.prototype.Add = function(time, flags, limits, raw, cal, pos, weight, motorPos, motorSpd)
+{
+    if (this.closed) return;
+    var d = new Date(time);
+    var day = d.getFullYear() + Pad2(d.getMonth()+1) + Pad2(d.getDate());
+    if (day != this.day) this.Open(day);
+    if (this.fd == null) return;
+
+    // add an index entry once a minute
+    if (time >= this.idxTime) {
+        var entry = Buffer.alloc(kIdxLen);
+        entry.writeDoubleLE(time, 0);
+        entry.writeDoubleLE(this.recNum, 8);
+        this.idx.push(entry);
+        this.idxTime = time - time % kIndexTime + kIndexTime;
+    }
+    var b = this.buff;
+    var i, j = this.num * kRecLen;
+    var bits = 0;
+    for (i=0; i<limits.length && i<8; ++i) if (limits[i]) bits |= (1 << i);
+    b.writeDoubleLE(time, j);
+    b[j+8] = kRecVersion;
+    b[j+9] = flags;
+    b[j+10] = bits;
+    b[j+11] = 0;
+    for (i=0; i<8; ++i) b.writeUInt16LE(raw[i] || 0, j + 12 + i * 2);
+    for (i=0; i<7; ++i) b.writeFloatLE(cal[i] || 0, j + 28 + i * 4);
+    for (i=0; i<3; ++i) {
+        b.writeFloatLE(pos[i], j + 56 + i * 4);
+        b.writeFloatLE(weight[i], j + 68 + i * 4);
+        b.writeInt32LE(motorPos[i] | 0, j + 80 + i * 4);
+        b.writeFloatLE(motorSpd[i], j + 92 + i * 4);
+    }
+    ++this.recNum;
+    if (++this.num >= kBatchRecs) {
+        this.Flush();
+    } else if (!this.flushTimer) {
+        var self = this;
+        this.flushTimer = setTimeout(function() { self.Flush() }, kFlushTime);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Open the archive file for the specified day (closing the previous one)
+// Inputs: day=date string (YYYYMMDD)
+Archive.prototype.Open = function(day)
+{
+    this.Flush();
+    if (this.fd != null) {
+        this.queue.push({ close: this.fd }, { close: this.idxFd });
+        this.fd = this.idxFd = null;
+    }
+    this.day = day;
+    this.idxTime = 0;
+    var file = this.prefix + day + '.dat';
+    try {
+        // (positional writes, so the order in which queued writes complete
+        //  doesn't matter -- see Close())
+        var flags = fs.constants.O_WRONLY | fs.constants.O_CREAT;
+        this.fd = fs.openSync(file, flags);
+        this.idxFd = fs.openSync(this.prefix + day + '.idx', flags);
+        // (pad out any partial record left at the end of the file)
+        var size = fs.fstatSync(this.fd).size;
+        this.recNum = Math.ceil(size / kRecLen);
+        this.datPos = this.recNum * kRecLen;
+        var pad = this.datPos - size;
+        if (pad) this.queue.push({ fd: this.fd, data: Buffer.alloc(pad), pos: size });
+        this.idxPos = fs.fstatSync(this.idxFd).size;
+    }
+    catch (err) {
+        console.log('Error opening archive', file);
+        this.fd = null;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Write buffered records and index entries
+Archive.prototype.Flush = function()
+{
+    clearTimeout(this.flushTimer);
+    this.flushTimer = null;
+    if (this.num) {
+        // (copy the data so we can continue buffering while it is written)
+        var data = Buffer.from(this.buff.subarray(0, this.num * kRecLen));
+        this.queue.push({ fd: this.fd, data: data, pos: this.datPos });
+        this.datPos += data.length;
+        this.num = 0;
+    }
+    if (this.idx.length) {
+        var entries = Buffer.concat(this.idx);
+        this.queue.push({ fd: this.idxFd, data: entries, pos: this.idxPos });
+        this.idxPos += entries.length;
+        this.idx = [];
+    }
+    this.WriteNext();
+}
+
+//-----------------------------------------------------------------------------
+// Perform the next queued file operation
+// (one at a time so the records are written in order)
+Archive.prototype.WriteNext = function()
+{
+    if (this.writing) return;
+    var self = this;
+    while (this.queue.length) {
+        var op = this.queue.shift();
+        try {
+            if (op.close != null) {
+                if (this.closed) fs.closeSync(op.close); else fs.close(op.close, function() { });
+            } else if (this.closed) {
+                fs.writeSync(op.fd, op.data, 0, op.data.length, op.pos);
+            } else {
+                this.writing = op;
+                fs.write(op.fd, op.data, 0, op.data.length, op.pos, function(error) {
+                    if (error) console.log(error, 'writing archive');
+                    self.writing = null;
+                    self.WriteNext();
+                });
+                return;
+            }
+        }
+        catch (err) {
+            console.log(err, 'writing archive');
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Write any buffered records and close the archive
+// Notes: Everything is written synchronously before returning, so the
+//        process may exit right away.  An asynchronous write still in
+//        progress is repeated synchronously (it may never complete if we
+//        exit), and its file is left open rather than closing the file
+//        descriptor out from under it.
+Archive.prototype.Close = function()
+{
+    if (this.closed) return;
+    this.Flush();
+    this.closed = 1;
+    var op = this.writing;
+    if (op) {
+        this.queue.unshift({ fd: op.fd, data: op.data, pos: op.pos });
+        this.writing = null;
+    }
+    if (this.fd != null) {
+        if (!op || op.fd != this.fd) this.queue.push({ close: this.fd });
+        if (!op || op.fd != this.idxFd) this.queue.push({ close: this.idxFd });
+        this.fd = this.idxFd = null;
+    }
+    this.WriteNext();
+}
+
+//-----------------------------------------------------------------------------
+// Decode an archive record
+// Inputs: b=buffer, j=offset of record in buffer
+// Returns: record object
+function Decode(b, j)
+{
+    var rec = {
+        time:   b.readDoubleLE(j),
+        flags:  b[j+9],
+        limits: [],
+        raw:    [],
+        cal:    [],
+        pos:    [],
+        weight: [],
+        motorPos: [],
+        motorSpd: []
+    };
+    var i;
+    for (i=0; i<6; ++i) rec.limits[i] = (b[j+10] >> i) & 0x01;
+    for (i=0; i<8; ++i) rec.raw[i] = b.readUInt16LE(j + 12 + i * 2);
+    for (i=0; i<7; ++i) rec.cal[i] = b.readFloatLE(j + 28 + i * 4);
+    for (i=0; i<3; ++i) {
+        rec.pos[i]      = b.readFloatLE(j + 56 + i * 4);
+        rec.weight[i]   = b.readFloatLE(j + 68 + i * 4);
+        rec.motorPos[i] = b.readInt32LE(j + 80 + i * 4);
+        rec.motorSpd[i] = b.readFloatLE(j + 92 + i * 4);
+    }
+    return rec;
+}
+
+//-----------------------------------------------------------------------------
+// Read records in a time range from an archive file
+// Inputs: file=archive file name, t0/t1=time range (ms), onRecord=called for
+//         each record object in the range, onDone=called with error (or null)
+//         when done
+// Notes: Uses the index file to seek close to the start time, then streams
+//        the records from there
+function Read(file, t0, t1, onRecord, onDone)
+{
+    var idxFile = file.replace(/\.dat$/, '') + '.idx';
+    fs.readFile(idxFile, function(error, idx) {
+        // find the last index entry before the start time
+        // (read the whole file if there is no index)
+        var start = 0;
+        if (!error) {
+            for (var i=0; i+kIdxLen<=idx.length; i+=kIdxLen) {
+                if (idx.readDoubleLE(i) > t0) break;
+                start = idx.readDoubleLE(i + 8);
+            }
+        }
+        var stream = fs.createReadStream(file, { start: start * kRecLen });
+        var left = null;    // partial record from the last chunk
+        var done = 0;
+        stream.on('data', function(data) {
+            if (left) data = Buffer.concat([left, data]);
+            var j;
+            for (j=0; j+kRecLen<=data.length; j+=kRecLen) {
+                var t = data.readDoubleLE(j);
+                if (t < t0 || data[j+8] != kRecVersion) continue;
+                if (t > t1) {
+                    done = 1;
+                    stream.destroy();
+                    onDone(null);
+                    return;
+                }
+                onRecord(Decode(data, j));
+            }
+            left = (j < data.length) ? data.slice(j) : null;
+        });
+        stream.on('error', function(error) {
+            if (!done) onDone(error);
+            done = 1;
+        });
+        stream.on('end', function() {
+            if (!done) onDone(null);
+            done = 1;
+        });
+    });
+}
+
+//-----------------------------------------------------------------------------
+// Parse a time from the command line
+// Returns: time (ms), or the default if no time was given
+function ParseTime(str, def)
+{
+    if (str == null) return def;
+    var t = /^\d+$/.test(str) ? Number(str) : new Date(str).getTime();
+    if (isNaN(t)) {
+        console.log('Invalid time:', str);
+        process.exit(1);
+    }
+    return t;
+}
+
+//-----------------------------------------------------------------------------
+// Print an archive record
+function PrintRecord(rec)
+{
+    var f = function(x) { return x.toFixed(4) };
+    console.log(new Date(rec.time).toISOString(),
+        'flags=' + rec.flags,
+        'raw=' + rec.raw.join(','),
+        'cal=' + rec.cal.map(f).join(','),
+        'pos=' + rec.pos.map(f).join(','),
+        'wt=' + rec.weight.map(f).join(','),
+        'mpos=' + rec.motorPos.join(','),
+        'mspd=' + rec.motorSpd.join(','),
+        'lim=' + rec.limits.join(''));
+}
+
+//-----------------------------------------------------------------------------
+// Pad integer to 2 digits
+function Pad2(num)
+{
+    var str = num.toString();
+    return((str.length < 2) ? '0'+str : str);
+}
+
+module.exports = {
+    Archive:     Archive,
+    Read:        Read,
+    Decode:      Decode,
+    kFlagAdam:   kFlagAdam,
+    kFlagAVR0:   kFlagAVR0,
+    kFlagActive: kFlagActive
+};
+
+//-----------------------------------------------------------------------------
+// end
@@ -19,6 +19,29 @@
 //              2016/03/17 - PH v1.12 - changed motor/pwm "run" command to "spd"
 //              2017/01/30 - PH v1.13 - added ability to specify ADC range
 //              2018/08/08 - PH v1.14 - added motor 0 step command
+//              2026/10/18 - PH v1.15 - bus delays now timed in nanoseconds using the
+//                                      CPU cycle counter ("cfg x=" values are in ns)
+//              2026/10/18 - PH v1.16 - added "cap" logic-capture command
+//              2026/10/18 - PH v1.17 - added "watch" command to push pin-change events
+//              2026/10/18 - PH v1.18 - added "m# enc" encoder following-error/stall monitor
+//              2026/10/18 - PH v1.19 - main loop now sleeps when idle, and added "load"
+//                                      command to report CPU utilization
+//              2026/10/18 - PH v1.20 - added always-on motor interrupt latency/duration
+//                                      histograms and "m# perf" command
+//              2026/10/18 - PH v1.21 - run CPU at 60 MHz from PLL0, and derive all timer,
+//                                      PWM, ADC and delay constants from FCPU
+//              2026/10/18 - PH v1.22 - added PWM pulse generators with ramping and pulse
+//                                      counting ("p# ramp", "p# acc"), on PWM1, PWM4 and
+//                                      PWM6 for DEAP (PWM6 only for MANIP/CUTE)
+//              2026/10/18 - PH v1.23 - added "m# trig" position-compare triggers
+//              2026/10/18 - PH v1.24 - added microsecond timebase, "time" command, and
+//                                      timestamps on motor status, ADC and GPIO replies
+//              2026/10/18 - PH v1.25 - motor state is preserved across resets, and added
+//                                      "save" command to store configuration in flash
+//              2026/10/18 - PH v1.26 - added "m# home" command to home motors to a limit switch
+//              2026/10/18 - PH v1.27 - added "m# goto" position servo mode
+//              2026/10/18 - PH v1.28 - added timestamped event log and "log" command
+//              2026/10/18 - PH v1.29 - added "m# hb" motion heartbeat
 //
 // Notes:       The embedded software is C because the inherent indirect
 //              addressing of C++ objects is too inefficient
@@ -49,6 +72,8 @@
 #include "tc.h"
 #include "wdt.h"
 #include "pwm.h"
+#include "cycle_counter.h"
+#include "flashc.h"
 #include "usb_drv.h"
 #include "usb_descriptors.h"
 #include "usb_standard_request.h"
@@ -57,10 +82,15 @@
 #define CUTE   		// use for CUTE expt
 
 //#define DEBUG       // enable debugging code
-#define VERSION		1.14
+#define VERSION		1.29
 
 #define NUM_MOTORS          3
 #define NUM_ADCS            4
+#if defined(MANIP) || defined(CUTE)
+#define NUM_PWMS            1       // PWM6 only (other PWM pins are used by the readout bus)
+#else
+#define NUM_PWMS            3       // PWM6, PWM1 and PWM4
+#endif
 
 #define TC0_CHANNEL      	0
 #define TC1_CHANNEL      	1
@@ -70,7 +100,10 @@
 
 #define PKT_SIZE            64      // maximum USB packet size
 
-#define FPBA              	FOSC0   // 12 MHz
+#define EVT_ID              '!'     // response index for unsolicited event messages
+
+#define FCPU                60000000L   // CPU clock (60 MHz from PLL0), used to time delays
+#define FPBA              	FCPU    // peripheral bus A clock (TC, PWM, ADC)
 
 #if defined(MANIP) || defined(CUTE)
 // SNO+ manip AVR channels
@@ -102,22 +135,58 @@ volatile U32 current_wdt_value = WDT_MAX_VALUE_US;
 
 //_____ D E F I N I T I O N S ______________________________________________
 
-#define kClockFreq		 12000000L // frequency for default tc clock source (3)
-#define kPrescale		 8      // prescale for default clock source (3)
+#define kClockFreq		 FPBA   // frequency for default tc clock source (4)
+#define kPrescale		 32     // prescale for default clock source (4)
 #define kMinTop 		 5      // limits maximum speed
 #define kMotorAccDefault 4000   // default motor acceleration in steps/sec/sec
+#define kServoSpdDefault 1000   // default maximum speed for position servo (steps/sec)
 #define kMotorAccMin     1000   // minimum motor acceleration (steps/sec/sec)
 #define kMotorAccMax     10000  // maximum motor acceleration (steps/sec/sec)
-#define kMinSpeed        25     // minimum motor speed (steps/sec)
+#define kMinSpeed        30     // minimum motor speed (steps/sec, RC must fit in 16 bits)
 #define kInitRC          kClockFreq / (kPrescale * (long)kMinSpeed) // initial RC value
 
-#define kMaxWaitConv     40     // maximum number of loops to wait for ADC conversion
+#define ADC_CLK_MAX      5000000L   // maximum AVR32 ADC clock frequency (Hz)
+#define ADC_PRESCAL      ((FPBA + 2 * ADC_CLK_MAX - 1) / (2 * ADC_CLK_MAX) - 1) // ADC prescaler for FPBA
+#define kMaxWaitConv     50000  // maximum time to wait for ADC conversion (ns)
+
+#define kPerfBins        16     // number of bins in ISR performance histograms
+
+#define kPwmAccDefault   4000   // default PWM ramp acceleration (pulses/sec/sec)
+#define kPwmAccMin       1000   // minimum PWM ramp acceleration (pulses/sec/sec)
+#define kPwmAccMax       1000000 // maximum PWM ramp acceleration (pulses/sec/sec)
+#define kPwmMinSpeed     30     // PWM ramp start/stop speed (pulses/sec)
+
+#define kMaxTrig         8      // maximum number of position triggers per motor
+#define kTrigQueue       16     // size of trigger event queue (power of 2)
+#define kTrigNoHi        0x7fffffffL        // trigger position when none above
+#define kTrigNoLo        (-0x7fffffffL - 1) // trigger position when none below
+
+#define kStateMagic      0x43555445 // checksum seed for motor state preserved across resets
+#define kConfigMagic     0x43464731 // magic number for configuration saved in flash user page
+#define kLogMagic        0x4c4f4731 // magic number for event log preserved across resets
+#define kLogSize         64     // number of event log records (power of 2)
+#define kMaxHeartbeat    60000  // maximum motion heartbeat timeout (ms)
+
+#define kEncRate         100    // encoder monitor sample rate (Hz)
+#define kEncStallCounts  3      // stall if encoder doesn't move for this many expected counts
 
 #define OUT_SIZE 		1024	// size of message response buffer
 
+#define kCapSize         3072   // logic capture buffer size (16-bit words)
+#define kCapMinCy        48     // minimum CPU cycles per capture sample (limits rate)
+#define kCapMaxTime      0.5    // maximum capture time and trigger wait time (sec)
+#define kCapChunk        384    // maximum hex digits returned by each "cap rd"
+
 __attribute__((__interrupt__)) static void m0_irq(void);
 __attribute__((__interrupt__)) static void m1_irq(void);
 __attribute__((__interrupt__)) static void m2_irq(void);
+__attribute__((__interrupt__)) static void pwm_irq(void);
+__attribute__((__interrupt__)) static void home_irq(void);
+U64 time_us(void);
+void log_add(int type, int arg, long val, const char *str);
+#if defined(MANIP) || defined(CUTE)
+void encoder_ref(int mot_num);
+#endif
 
 //_____ D E C L A R A T I O N S ____________________________________________
 
@@ -243,15 +312,141 @@ static struct {
     .function   = AVR32_ADC_AD_7_FUNCTION,
 }};
 
-static U16  sof_cnt;
+// PWM pulse generator channels ("p#" command)
+static struct {
+    int channel;
+    int pin;
+    int function;
+} sPWM[NUM_PWMS] = {
+{
+    .channel    = 6,
+    .pin        = AVR32_PWM_6_2_PIN,        // PA31
+    .function   = AVR32_PWM_6_2_FUNCTION,
+#if !defined(MANIP) && !defined(CUTE)
+},{
+    .channel    = 1,
+    .pin        = AVR32_PWM_1_0_PIN,        // PA08
+    .function   = AVR32_PWM_1_0_FUNCTION,
+},{
+    .channel    = 4,
+    .pin        = AVR32_PWM_4_1_PIN,        // PA16
+    .function   = AVR32_PWM_4_1_FUNCTION,
+#endif
+}};
+
+// motor limit switch inputs (active low, or -1 for none)
+static struct {
+    int hi;     // limit switch reached when moving in positive direction
+    int lo;     // limit switch reached when moving in negative direction
+} sLimit[NUM_MOTORS] = {
+#ifdef CUTE
+    { 0, 1 },   // PA00 = top, PA01 = bottom
+    { 2, 3 },   // PA02 = top, PA03 = bottom
+    { 4, 5 }    // PA04 = top, PA05 = bottom
+#else
+    { -1, -1 }, { -1, -1 }, { -1, -1 }
+#endif
+};
+
+// PWM channel state
+// NOTE: "ISR" variables are changed in interrupt routine!
+static struct {
+    char            run;        // ISR 0=stopped, 1=running
+    char            ramping;    // flag that speed is being ramped by pwm_task()
+    unsigned long   rc;         // current period (PWM clock ticks)
+    float           spd;        // current requested speed (pulses/sec, actual is PWM_CLK/rc)
+    float           target;     // ramp target speed (pulses/sec, 0=stop)
+    unsigned        acc;        // ramp acceleration (pulses/sec/sec)
+    long            count;      // ISR number of pulses output since counting started
+    long            num;        // ISR stop after this many pulses (0=don't count)
+} pwm[NUM_PWMS];
+
+static volatile U32 sof_cnt;    // USB start-of-frame count (1 ms ticks)
 static U16  data_length;
 static char has_data;
+static char out_buff[OUT_SIZE]; // response message buffer
 static char wdt_flag = 0;   // 0=not enabled, 1=power up, 2=WDT reset
-static char pwm_flag = 0;   // 0=not initialized, 1=stopped, 2=running
+static char pwm_flag = 0;   // 0=not initialized, 1=initialized
+static volatile U32 time_ms = 0;    // ISR timebase milliseconds (PWM5 periods)
 
 // PIO channel output modes (0=input, 1=output, 2=input /w pull-up, 3=other function)
 static char output_mode[64] = { 0 };
 
+// logic capture
+static U16  cap_buff[kCapSize]; // captured port samples (1 word for PB, 2 for PA, 3 for both)
+static char cap_port = 0;       // captured port ('a'=PA, 'b'=PB, 'x'=both, 0=nothing captured)
+static int  cap_num = 0;        // number of samples in capture buffer
+static int  cap_pos = 0;        // next sample to return for "cap rd"
+static U32  cap_cy;             // CPU cycles per capture sample
+
+// pin-change watch
+static U32  watch_mask[2];      // watched channels in ports A and B
+static U32  watch_last[2];      // last state of watched channels
+static int  watch_lost = 0;     // number of watch events lost due to a full output buffer
+
+// motor position triggers
+enum {
+    TRIG_CLR,                   // clear output pin
+    TRIG_SET,                   // set output pin
+    TRIG_ADC,                   // start conversion of internal ADC
+    TRIG_LOG                    // log event
+};
+static struct {
+    long    pos;                // motor position for trigger
+    char    action;             // trigger action (TRIG_...)
+    char    chan;               // pin number (PB = 32-43) or ADC number
+} trig[NUM_MOTORS][kMaxTrig];   // position triggers for each motor (sorted by position)
+static int  trig_num[NUM_MOTORS];   // number of triggers for each motor
+static struct {
+    char    mot;                // motor number
+    char    action;             // trigger action
+    char    chan;               // ADC number
+    long    pos;                // motor position
+    U64     time;               // timebase time when triggered (us)
+    int     val;                // ADC value (-1 if not read yet)
+} trig_evt[kTrigQueue];         // ISR queue of fired ADC/log triggers
+static volatile int trig_head = 0;  // ISR trigger event queue head
+static int  trig_tail = 0;          // trigger event queue tail
+static int  trig_lost = 0;          // ISR number of trigger events lost due to full queue
+
+// motor homing
+enum {
+    HOME_IDLE,                  // not homing
+    HOME_SEEK,                  // moving fast toward the limit switch
+    HOME_STOP1,                 // stopping after reaching the switch
+    HOME_BACKOFF,               // moving slowly away until the switch releases, then BACKOFF steps
+    HOME_STOP2,                 // stopping after backing off
+    HOME_APPROACH,              // moving slowly toward the switch until it is latched
+    HOME_STOP3                  // stopping after the switch was latched
+};
+static const char *home_state_str[] = { "IDLE","SEEK","STOP","BACKOFF","STOP","APPROACH","STOP" };
+static struct {
+    char    state;              // homing state (HOME_...)
+    char    dir;                // direction toward the limit switch (0=+ve, 1=-ve)
+    char    released;           // flag set when the switch released during back off
+    int     pin;                // limit switch input
+    int     fast;               // seek speed (steps/sec)
+    int     slow;               // back off and approach speed (steps/sec)
+    long    backoff;            // distance to back off after the switch releases (steps)
+    long    ofs;                // position to set at the switch
+    long    release;            // motor position where the switch released
+    volatile char latched;      // ISR flag set when switch is latched
+    volatile long latch;        // ISR motor position when the switch was latched
+} home[NUM_MOTORS];
+
+// motion heartbeat (motor is stopped if moving and no "m#" command is received within timeout)
+static U16  hb_ms[NUM_MOTORS];      // heartbeat timeout (ms, or 0 for none)
+static U32  hb_last[NUM_MOTORS];    // time_ms at last "m#" command
+static char hb_tripped[NUM_MOTORS]; // flag set when motor was stopped by the heartbeat
+
+// main loop scheduling
+#define EVT_SOF     0x01            // sched_flags bit set by USB start-of-frame interrupt
+static volatile U32 sched_flags = 0;// event flags set by interrupts for the main loop
+static U32  task_ms = 0;            // time_ms when the 1 ms main loop tasks last ran
+static U64  load_start;             // time_us() at start of CPU load measurement
+static U64  load_idle = 0;          // microseconds spent idle (asleep, or polling watched inputs)
+static U32  load_maxLoop = 0;       // maximum cycles for one pass of the main loop
+
 // configuration
 #if defined(MANIP) || defined(CUTE)
 #define kNumAdrLines 	4
@@ -265,14 +460,19 @@ int cfg_dat[kNumDatLines] = {
     RDAT, RDAT+1, RDAT+2, RDAT+3, RDAT+4, RDAT+5, RDAT+6, RDAT+7
 };
 #define kNumDelay       6
-int cfg_del[kNumDelay] = {
-    0,  // counter delay after raising RST and after enable output
-    0,  // counter delay for data to stabilize (min 65ns)
-    0,  // adc delay before initiate conversion (min 50ns)
-    0,  // adc delay for conversion (min 10us) [now wait for INT to go low]
-    0,  // adc delay for data to stabilize (min 150ns)
-    0,  // adc delay before reading low byte (min ??)
+#define kMaxDelay       1000000 // maximum configurable delay (ns)
+int cfg_del[kNumDelay] = {      // (all delays in ns)
+    65,     // counter delay after raising RST and after enable output
+    65,     // counter delay for data to stabilize (min 65ns)
+    50,     // adc delay before initiate conversion (min 50ns)
+    10000,  // adc delay for conversion (min 10us) [now wait for INT to go low]
+    150,    // adc delay for data to stabilize (min 150ns)
+    0,      // adc delay before reading high byte (min ??)
 };
+U32 del_cy[kNumDelay];          // delays converted to CPU cycles (see set_delays())
+
+// convert nanoseconds to CPU cycles, rounding up so we never wait too short a time
+#define NS_TO_CY(ns)    (((U32)(ns) * (FCPU / 1000000L) + 999) / 1000)
 
 #define A0      cfg_adr[0]
 #define A1      cfg_adr[1]
@@ -280,8 +480,76 @@ int cfg_del[kNumDelay] = {
 #define A3      cfg_adr[3]
 
 int dig_out[4] = { 0 };     // digital output bytes for Steve's modified board
+
+// encoder monitor for each motor (encoders are read through Steve's counter boards)
+static struct {
+    signed char brd;    // counter board number (-1 = monitor off)
+    char    tripped;    // set when an error was reported (cleared when motor stops)
+    float   scale;      // motor steps per encoder count (-ve if encoder counts backwards)
+    long    tol;        // maximum following error (steps)
+    U16     last;       // last counter reading
+    long    count;      // encoder counts since reference
+    long    ref;        // motor position at reference
+    long    err;        // current following error (steps)
+    long    maxErr;     // maximum absolute following error (steps)
+    long    stallPos;   // motor position when encoder last changed
+} sEnc[NUM_MOTORS] = { { .brd = -1 }, { .brd = -1 }, { .brd = -1 } };
 #endif
 
+// motor state preserved across resets (in RAM that isn't cleared at startup)
+static struct {
+    long            pos[NUM_MOTORS];    // motor positions
+    U32             acc[NUM_MOTORS];    // motor accelerations
+    unsigned char   dir[NUM_MOTORS];    // motor direction flags
+    char            dirInv[NUM_MOTORS]; // direction signal inverted flags
+    char            onInv[NUM_MOTORS];  // windings on signal inverted flags
+    char            moving;             // bit mask of motors that were moving
+} sState __attribute__((section(".noinit")));
+
+// event log types
+enum {
+    LOG_RESET,      // firmware started (val = reset cause register)
+    LOG_BAD,        // command rejected (arg = command index, str = error)
+    LOG_FULL,       // response buffer full, so a response was lost (arg = command index, val = length)
+    LOG_LOST,       // trigger event lost because the queue was full (arg = motor, val = position)
+    LOG_STOP,       // motor stopped by firmware (arg = motor, val = position, str = reason)
+    LOG_HOME        // motor homed (arg = motor, val = position)
+};
+static const char *log_type_str[] = { "RESET","BAD","FULL","LOST","STOP","HOME" };
+
+// event log record
+typedef struct {
+    U64         time;           // time of event (us, see time_us())
+    const char  *str;           // static string (or NULL)
+    long        val;            // event value
+    char        type;           // event type (LOG_...)
+    char        arg;            // event argument
+} LogRec;
+
+// event log ring buffer (preserved across resets, except at power up)
+static struct {
+    U32     magic;              // kLogMagic if valid
+    U32     head;               // ISR sequence number of next record to add
+    U32     tail;               // ISR sequence number of next record to drain
+    U32     lost;               // ISR number of records overwritten before they were drained
+    LogRec  rec[kLogSize];
+} evt_log __attribute__((section(".noinit")));
+
+static char state_restored = 0;     // 1 if motor state was restored at startup (2 if a motor was moving)
+
+// configuration saved in flash user page by "save" command
+typedef struct {
+    U32     magic;                  // kConfigMagic if valid
+    U32     acc[NUM_MOTORS];        // motor accelerations
+    char    dirInv[NUM_MOTORS];     // direction signal inverted flags
+    char    onInv[NUM_MOTORS];      // windings on signal inverted flags
+#if defined(MANIP) || defined(CUTE)
+    int     adr[kNumAdrLines];      // readout bus address lines
+    int     dat[kNumDatLines];      // readout bus data lines
+    int     del[kNumDelay];         // readout bus delays (ns)
+#endif
+} sConfig;
+
 int motor_src[5] = {
     TC_CLOCK_SOURCE_TC1,
     TC_CLOCK_SOURCE_TC2,
@@ -289,27 +557,13 @@ int motor_src[5] = {
     TC_CLOCK_SOURCE_TC4,
     TC_CLOCK_SOURCE_TC5
 };
-/*int motor_freq[5] = {
-    32000,
-    12000000,
-    12000000,
-    12000000,
-    12000000
-};
-int motor_prescale[5] = {
-    1,
-    2,
-    8,
-    32,
-    128
-};*/
 // actual frequency for each tc clock source
 int motor_actClock[5] = {
     32768,      // 32 kHz / 1
-    6000000,    // 12 MHz / 2
-    1500000,    // 12 MHz / 8
-    375000,     // 12 MHz / 32
-    93750       // 12 MHz / 128
+    FPBA / 2,   // 30 MHz
+    FPBA / 8,   // 7.5 MHz
+    FPBA / 32,  // 1.875 MHz
+    FPBA / 128  // 468.75 kHz
 };
 
 // motor variables
@@ -324,11 +578,14 @@ unsigned char   m0_running = 0;         // ISR flag that motor is running
 unsigned        m0_curSpeed = kMinSpeed;// ISR current speed in Hz
 unsigned        m0_endSpeed;            // ISR ramp end speed in Hz
 unsigned        m0_curRC = kInitRC;     // ISR current counter RC value
-#ifdef DEBUG
-unsigned        m0_latency = 0;         // ISR maximum latency of interrupt
-unsigned        m0_lastCount = 0;       // ISR latency of last interrupt
-#endif
-unsigned long   m0_actClock = 1500000;  // actual clock freq = kClockFreq / kPrescale
+unsigned        m0_latHist[kPerfBins];  // ISR histogram of interrupt entry latency (log2 TC ticks)
+unsigned        m0_durHist[kPerfBins];  // ISR histogram of interrupt duration (log2 CPU cycles)
+unsigned        m0_latMax = 0;          // ISR maximum entry latency (TC ticks)
+unsigned        m0_durMax = 0;          // ISR maximum duration (CPU cycles)
+unsigned        m0_drops = 0;           // ISR number of nested entries (ramp update skipped)
+long            m0_trigHi = kTrigNoHi;   // ISR next trigger position above motor position
+long            m0_trigLo = kTrigNoLo;   // ISR next trigger position below motor position
+unsigned long   m0_actClock = kClockFreq / kPrescale;   // actual clock freq
 unsigned        m0_startSpeed;          // motor start speed
 unsigned int    m0_acc = kMotorAccDefault;  // motor acceleration (steps/s/s)
 long            m0_rampTime;            // time motor has been ramping (TC ticks)
@@ -337,11 +594,15 @@ float           m0_rampScl = (float)(kClockFreq / kPrescale) / kMotorAccDefault;
 int             m0_minSpeed = kMinSpeed;
 unsigned char   m0_stopFlag = 0;        // ISR flag to stop motor
 unsigned char   m0_stepMode = 0;        // 0=done, 1=ramp up, 2=cruise, 3=ramp down
-int             m0_src = 3;             // source clock
+int             m0_src = 4;             // source clock
 long            m0_stepFrom;            // step start
 long            m0_stepTo;              // step end
 long            m0_rampEnd;             // step where ramp was completed
 long            m0_stepNext;            // step where we have to change something
+unsigned char   m0_servo = 0;           // flag for position servo mode ("m# goto")
+long            m0_servoTo;             // servo target position
+unsigned        m0_servoMax = kServoSpdDefault; // servo maximum speed (steps/sec)
+float           m0_servoSpd;            // ISR servo speed (steps/sec)
 
 long            m1_motorPos = 0;
 unsigned char   m1_motorDir = 0;
@@ -353,11 +614,14 @@ unsigned char   m1_running = 0;
 unsigned        m1_curSpeed = kMinSpeed;
 unsigned        m1_endSpeed;
 unsigned        m1_curRC = kInitRC;
-#ifdef DEBUG
-unsigned        m1_latency = 0;
-unsigned        m1_lastCount = 0;
-#endif
-unsigned long   m1_actClock = 1500000;
+unsigned        m1_latHist[kPerfBins];
+unsigned        m1_durHist[kPerfBins];
+unsigned        m1_latMax = 0;
+unsigned        m1_durMax = 0;
+unsigned        m1_drops = 0;
+long            m1_trigHi = kTrigNoHi;
+long            m1_trigLo = kTrigNoLo;
+unsigned long   m1_actClock = kClockFreq / kPrescale;
 unsigned        m1_startSpeed;
 unsigned int    m1_acc = kMotorAccDefault;
 long            m1_rampTime;
@@ -365,7 +629,11 @@ long            m1_rampEndTime;
 float           m1_rampScl = (float)(kClockFreq / kPrescale) / kMotorAccDefault;
 int             m1_minSpeed = kMinSpeed;
 unsigned char   m1_stopFlag = 0;
-int             m1_src = 3;             // source clock
+int             m1_src = 4;             // source clock
+unsigned char   m1_servo = 0;
+long            m1_servoTo;
+unsigned        m1_servoMax = kServoSpdDefault;
+float           m1_servoSpd;
 
 long            m2_motorPos = 0;
 unsigned char   m2_motorDir = 0;
@@ -377,11 +645,14 @@ unsigned char   m2_running = 0;
 unsigned        m2_curSpeed = kMinSpeed;
 unsigned        m2_endSpeed;
 unsigned        m2_curRC = kInitRC;
-#ifdef DEBUG
-unsigned        m2_latency = 0;
-unsigned        m2_lastCount = 0;
-#endif
-unsigned long   m2_actClock = 1500000;
+unsigned        m2_latHist[kPerfBins];
+unsigned        m2_durHist[kPerfBins];
+unsigned        m2_latMax = 0;
+unsigned        m2_durMax = 0;
+unsigned        m2_drops = 0;
+long            m2_trigHi = kTrigNoHi;
+long            m2_trigLo = kTrigNoLo;
+unsigned long   m2_actClock = kClockFreq / kPrescale;
 unsigned        m2_startSpeed;
 unsigned int    m2_acc = kMotorAccDefault;
 long            m2_rampTime;
@@ -389,7 +660,11 @@ long            m2_rampEndTime;
 float           m2_rampScl = (float)(kClockFreq / kPrescale) / kMotorAccDefault;
 int             m2_minSpeed = kMinSpeed;
 unsigned char   m2_stopFlag = 0;
-int             m2_src = 3;             // source clock
+int             m2_src = 4;             // source clock
+unsigned char   m2_servo = 0;
+long            m2_servoTo;
+unsigned        m2_servoMax = kServoSpdDefault;
+float           m2_servoSpd;
 
 static tc_waveform_opt_t waveform_opt[NUM_MOTORS] = {
 {
@@ -414,7 +689,7 @@ static tc_waveform_opt_t waveform_opt[NUM_MOTORS] = {
 
     .burst    = TC_BURST_NOT_GATED,           // Burst signal selection.
     .clki     = TC_CLOCK_RISING_EDGE,         // Clock inversion.
-    .tcclks   = TC_CLOCK_SOURCE_TC3           // Internal source clock 3, connected to fPBA / 8. (pg 522)
+    .tcclks   = TC_CLOCK_SOURCE_TC4           // Internal source clock 4, connected to fPBA / 32. (pg 522)
 },{
     .channel  = TC1_CHANNEL,        // Channel selection.
 
@@ -437,7 +712,7 @@ static tc_waveform_opt_t waveform_opt[NUM_MOTORS] = {
 
     .burst    = TC_BURST_NOT_GATED,           // Burst signal selection.
     .clki     = TC_CLOCK_RISING_EDGE,         // Clock inversion.
-    .tcclks   = TC_CLOCK_SOURCE_TC3           // Internal source clock 3, connected to fPBA / 8. (pg 522)
+    .tcclks   = TC_CLOCK_SOURCE_TC4           // Internal source clock 4, connected to fPBA / 32. (pg 522)
 },{
     .channel  = TC2_CHANNEL,        // Channel selection.
 
@@ -460,9 +735,98 @@ static tc_waveform_opt_t waveform_opt[NUM_MOTORS] = {
 
     .burst    = TC_BURST_NOT_GATED,           // Burst signal selection.
     .clki     = TC_CLOCK_RISING_EDGE,         // Clock inversion.
-    .tcclks   = TC_CLOCK_SOURCE_TC3           // Internal source clock 3, connected to fPBA / 8. (pg 522)
+    .tcclks   = TC_CLOCK_SOURCE_TC4           // Internal source clock 4, connected to fPBA / 32. (pg 522)
 }};
 
+//-----------------------------------------------------------------------------
+// set motor trigger positions bracketing the current position
+// (the motor interrupt calls trig_fire() when the position reaches one of these)
+static void trig_arm(int mot_num, long hi, long lo)
+{
+    switch (mot_num) {
+      case 0:
+        m0_trigHi = hi;
+        m0_trigLo = lo;
+        break;
+      case 1:
+        m1_trigHi = hi;
+        m1_trigLo = lo;
+        break;
+      default:
+        m2_trigHi = hi;
+        m2_trigLo = lo;
+        break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// fire the triggers at the current motor position and re-arm for the next ones
+// (called from the motor interrupt before interrupts are re-enabled, and also
+//  with fire=0 and interrupts disabled to re-arm after the trigger list changes)
+static void trig_fire(int mot_num, long pos, int fire)
+{
+    long hi = kTrigNoHi, lo = kTrigNoLo;
+    int i, at = 0;
+
+    for (i=0; i<trig_num[mot_num]; ++i) {
+        if (trig[mot_num][i].pos < pos) {
+            lo = trig[mot_num][i].pos;  // (sorted, so the last one below is the closest)
+            continue;
+        }
+        if (trig[mot_num][i].pos > pos) {
+            hi = trig[mot_num][i].pos;
+            break;
+        }
+        at = 1;
+        if (!fire) continue;
+        int chan = trig[mot_num][i].chan;
+        switch (trig[mot_num][i].action) {
+          case TRIG_CLR:
+            gpio_clr_gpio_pin(chan);
+            output_mode[chan] = 1;
+            break;
+          case TRIG_SET:
+            gpio_set_gpio_pin(chan);
+            output_mode[chan] = 1;
+            break;
+          case TRIG_ADC:
+            // (the main loop does the conversion, so it can't collide with an
+            //  "adc#" command that is using the ADC)
+          case TRIG_LOG: {
+            int next = (trig_head + 1) & (kTrigQueue - 1);
+            if (next == trig_tail) {
+                ++trig_lost;
+                log_add(LOG_LOST, mot_num, pos, NULL);
+                break;
+            }
+            trig_evt[trig_head].mot = mot_num;
+            trig_evt[trig_head].action = trig[mot_num][i].action;
+            trig_evt[trig_head].chan = chan;
+            trig_evt[trig_head].pos = pos;
+            trig_evt[trig_head].time = time_us();
+            trig_evt[trig_head].val = -1;
+            trig_head = next;
+          } break;
+        }
+    }
+    // if we are at a trigger, arm the adjacent positions so we re-arm this
+    // trigger when we move off, and fire it again if we come back
+    if (at) {
+        if (hi > pos + 1) hi = pos + 1;
+        if (lo < pos - 1) lo = pos - 1;
+    }
+    trig_arm(mot_num, hi, lo);
+}
+
+//-----------------------------------------------------------------------------
+// get performance histogram bin for a value
+// (bin 0 is 0, bin N holds 2^(N-1) to 2^N-1, and the last bin holds everything larger)
+static inline int perf_bin(U32 val)
+{
+    int bin = val ? 32 - __builtin_clz(val) : 0;   // (clz is a single AVR32 instruction)
+    return bin < kPerfBins ? bin : kPerfBins - 1;
+}
+
 //-----------------------------------------------------------------------------
 /*! \brief timer interrupt for motor
  */
@@ -470,10 +834,16 @@ __attribute__((__interrupt__))
 static void m0_irq(void)
 {
    static char in = 0;
+   U32 start = Get_sys_count();
+   // the counter restarted at the RC compare, so it holds our entry latency
+   unsigned lat = AVR32_TC.channel[TC0_CHANNEL].cv;
 
    // clear the interrupt flag by reading the TC status register
    tc_read_sr(&AVR32_TC, TC0_CHANNEL);
 
+   ++m0_latHist[perf_bin(lat)];
+   if (lat > m0_latMax) m0_latMax = lat;
+
 #ifdef DEBUG
    static unsigned long ticks = 0;
    ticks++;
@@ -489,20 +859,74 @@ static void m0_irq(void)
            ++m0_motorPos;
        }
    }
+   // fire position triggers (before re-enabling interrupts)
+   if (m0_motorPos == m0_trigHi || m0_motorPos == m0_trigLo) trig_fire(0, m0_motorPos, 1);
+
    // return now if already inside interrupt
-   if (in) return;
+   if (in) {
+       ++m0_drops;
+       return;
+   }
    in = 1;
    
    // re-enable interrupts so we don't miss a count
    Enable_interrupt_level(0);
 
+   if (m0_servo) {
+       // position servo: plan the speed of the next step toward the target
+       long dist = m0_servoTo - m0_motorPos;
+       if (m0_motorDir) dist = -dist;   // (distance ahead in our direction of travel)
+       float spd = m0_servoSpd;
+       if (dist <= 0 && spd <= m0_minSpeed) {
+           if (!dist) {
+               // we are at the target, so stop
+               tc_stop(&AVR32_TC, TC0_CHANNEL);
+               m0_curSpeed = kMinSpeed;
+               m0_running = 0;
+           } else {
+               // reverse direction at the slowest speed
+               m0_motorDir ^= 1;
+               if (m0_motorDir ^ sMotor[0].dirInv) {
+                   gpio_set_gpio_pin(sMotor[0].dir);
+               } else {
+                   gpio_clr_gpio_pin(sMotor[0].dir);
+               }
+           }
+       } else {
+           float dv = m0_curRC / m0_rampScl;    // speed change over this step
+           // slow down if we are going the wrong way, or if we need the
+           // remaining distance to decelerate to the minimum speed
+           if (dist <= 0 || spd * spd - (float)m0_minSpeed * m0_minSpeed >= 2.0f * m0_acc * (dist - 1)) {
+               spd -= dv;
+               if (spd < m0_minSpeed) spd = m0_minSpeed;
+           } else if (spd < m0_servoMax) {
+               spd += dv;
+               if (spd > m0_servoMax) spd = m0_servoMax;
+           } else if (spd > m0_servoMax) {
+               spd -= dv;
+               if (spd < m0_servoMax) spd = m0_servoMax;
+           }
+           m0_servoSpd = spd;
+           m0_curSpeed = (unsigned)spd;
+           m0_curRC = (unsigned)(kClockFreq / kPrescale / spd);
+           // set RA/RC for new frequency
+           tc_write_ra(&AVR32_TC, TC0_CHANNEL, m0_curRC >> 1);
+           tc_write_rc(&AVR32_TC, TC0_CHANNEL, m0_curRC);
+       }
+       U32 dur = Get_sys_count() - start;
+       ++m0_durHist[perf_bin(dur)];
+       if (dur > m0_durMax) m0_durMax = dur;
+       in = 0;
+       return;
+   }
+
    if (m0_stepMode && ((long)((m0_motorPos - m0_stepNext) * (1 - 2 * (long)m0_motorDir)) > -2)) {
        switch (m0_stepMode) {
           case 1:   // ramp down in middle of ramping up
           case 2:   // ramp down from cruising
              m0_stepMode = 3;
              m0_stepNext = m0_stepTo;
-             m0_rampTo = 60000; // = m0_actClock / m0_minSpeed
+             m0_rampTo = (unsigned int)(m0_actClock / m0_minSpeed);
              m0_rampFlag = 2;
              break;
           case 3:   // time to stop
@@ -527,9 +951,6 @@ static void m0_irq(void)
            }
            m0_rampTime = 0;
            m0_ramping = 1;
-#ifdef DEBUG
-           m0_latency = 0;
-#endif
        }
 	} else if (m0_ramping) {
 	   m0_rampTime += m0_curRC;
@@ -538,6 +959,9 @@ static void m0_irq(void)
 		   if (m0_stopFlag >= 2) {
 		       if ((m0_stopFlag == 2) && m0_stepMode) {
 		          // don't stop until we reach our end point
+		          U32 dur = Get_sys_count() - start;
+		          ++m0_durHist[perf_bin(dur)];
+		          if (dur > m0_durMax) m0_durMax = dur;
 		          in = 0;
 		          return;
 		       }
@@ -564,15 +988,11 @@ static void m0_irq(void)
 	   // set RA/RC for new frequency
 	   tc_write_ra(&AVR32_TC, TC0_CHANNEL, m0_curRC >> 1);
 	   tc_write_rc(&AVR32_TC, TC0_CHANNEL, m0_curRC);
-#ifdef DEBUG
-	   unsigned int lat = tc_read_tc(&AVR32_TC, TC0_CHANNEL);
-	   if (lat > m0_latency) m0_latency = lat;
-#endif
 	}
 	
-#ifdef DEBUG
-	m0_lastCount = tc_read_tc(&AVR32_TC, TC0_CHANNEL);
-#endif
+    U32 dur = Get_sys_count() - start;
+    ++m0_durHist[perf_bin(dur)];
+    if (dur > m0_durMax) m0_durMax = dur;
     in = 0;
 }
 
@@ -583,10 +1003,16 @@ __attribute__((__interrupt__))
 static void m1_irq(void)
 {
    static char in = 0;
+   U32 start = Get_sys_count();
+   // the counter restarted at the RC compare, so it holds our entry latency
+   unsigned lat = AVR32_TC.channel[TC1_CHANNEL].cv;
 
    // clear the interrupt flag by reading the TC status register
    tc_read_sr(&AVR32_TC, TC1_CHANNEL);
 
+   ++m1_latHist[perf_bin(lat)];
+   if (lat > m1_latMax) m1_latMax = lat;
+
 #ifdef DEBUG
    static unsigned long ticks = 0;
    ticks++;
@@ -602,13 +1028,67 @@ static void m1_irq(void)
            ++m1_motorPos;
        }
    }
+   // fire position triggers (before re-enabling interrupts)
+   if (m1_motorPos == m1_trigHi || m1_motorPos == m1_trigLo) trig_fire(1, m1_motorPos, 1);
+
    // return now if already inside interrupt
-   if (in) return;
+   if (in) {
+       ++m1_drops;
+       return;
+   }
    in = 1;
    
    // re-enable interrupts so we don't miss a count
    Enable_interrupt_level(0);
 
+   if (m1_servo) {
+       // position servo: plan the speed of the next step toward the target
+       long dist = m1_servoTo - m1_motorPos;
+       if (m1_motorDir) dist = -dist;   // (distance ahead in our direction of travel)
+       float spd = m1_servoSpd;
+       if (dist <= 0 && spd <= m1_minSpeed) {
+           if (!dist) {
+               // we are at the target, so stop
+               tc_stop(&AVR32_TC, TC1_CHANNEL);
+               m1_curSpeed = kMinSpeed;
+               m1_running = 0;
+           } else {
+               // reverse direction at the slowest speed
+               m1_motorDir ^= 1;
+               if (m1_motorDir ^ sMotor[1].dirInv) {
+                   gpio_set_gpio_pin(sMotor[1].dir);
+               } else {
+                   gpio_clr_gpio_pin(sMotor[1].dir);
+               }
+           }
+       } else {
+           float dv = m1_curRC / m1_rampScl;    // speed change over this step
+           // slow down if we are going the wrong way, or if we need the
+           // remaining distance to decelerate to the minimum speed
+           if (dist <= 0 || spd * spd - (float)m1_minSpeed * m1_minSpeed >= 2.0f * m1_acc * (dist - 1)) {
+               spd -= dv;
+               if (spd < m1_minSpeed) spd = m1_minSpeed;
+           } else if (spd < m1_servoMax) {
+               spd += dv;
+               if (spd > m1_servoMax) spd = m1_servoMax;
+           } else if (spd > m1_servoMax) {
+               spd -= dv;
+               if (spd < m1_servoMax) spd = m1_servoMax;
+           }
+           m1_servoSpd = spd;
+           m1_curSpeed = (unsigned)spd;
+           m1_curRC = (unsigned)(kClockFreq / kPrescale / spd);
+           // set RA/RC for new frequency
+           tc_write_ra(&AVR32_TC, TC1_CHANNEL, m1_curRC >> 1);
+           tc_write_rc(&AVR32_TC, TC1_CHANNEL, m1_curRC);
+       }
+       U32 dur = Get_sys_count() - start;
+       ++m1_durHist[perf_bin(dur)];
+       if (dur > m1_durMax) m1_durMax = dur;
+       in = 0;
+       return;
+   }
+
    if (m1_rampFlag) {
        m1_stopFlag = m1_rampFlag;
        m1_rampFlag = 0;
@@ -625,9 +1105,6 @@ static void m1_irq(void)
            }
            m1_rampTime = 0;
            m1_ramping = 1;
-#ifdef DEBUG
-           m1_latency = 0;
-#endif
        }
 	} else if (m1_ramping) {
 	   m1_rampTime += m1_curRC;
@@ -651,15 +1128,11 @@ static void m1_irq(void)
 	   // set RA/RC for new frequency
 	   tc_write_ra(&AVR32_TC, TC1_CHANNEL, m1_curRC >> 1);
 	   tc_write_rc(&AVR32_TC, TC1_CHANNEL, m1_curRC);
-#ifdef DEBUG
-	   unsigned int lat = tc_read_tc(&AVR32_TC, TC1_CHANNEL);
-	   if (lat > m1_latency) m1_latency = lat;
-#endif
 	}
 	
-#ifdef DEBUG
-	m1_lastCount = tc_read_tc(&AVR32_TC, TC1_CHANNEL);
-#endif
+    U32 dur = Get_sys_count() - start;
+    ++m1_durHist[perf_bin(dur)];
+    if (dur > m1_durMax) m1_durMax = dur;
     in = 0;
 }
 
@@ -670,10 +1143,16 @@ __attribute__((__interrupt__))
 static void m2_irq(void)
 {
    static char in = 0;
+   U32 start = Get_sys_count();
+   // the counter restarted at the RC compare, so it holds our entry latency
+   unsigned lat = AVR32_TC.channel[TC2_CHANNEL].cv;
 
    // clear the interrupt flag by reading the TC status register
    tc_read_sr(&AVR32_TC, TC2_CHANNEL);
 
+   ++m2_latHist[perf_bin(lat)];
+   if (lat > m2_latMax) m2_latMax = lat;
+
 #ifdef DEBUG
    static unsigned long ticks = 0;
    ticks++;
@@ -689,13 +1168,67 @@ static void m2_irq(void)
            ++m2_motorPos;
        }
    }
+   // fire position triggers (before re-enabling interrupts)
+   if (m2_motorPos == m2_trigHi || m2_motorPos == m2_trigLo) trig_fire(2, m2_motorPos, 1);
+
    // return now if already inside interrupt
-   if (in) return;
+   if (in) {
+       ++m2_drops;
+       return;
+   }
    in = 1;
    
    // re-enable interrupts so we don't miss a count
    Enable_interrupt_level(0);
 
+   if (m2_servo) {
+       // position servo: plan the speed of the next step toward the target
+       long dist = m2_servoTo - m2_motorPos;
+       if (m2_motorDir) dist = -dist;   // (distance ahead in our direction of travel)
+       float spd = m2_servoSpd;
+       if (dist <= 0 && spd <= m2_minSpeed) {
+           if (!dist) {
+               // we are at the target, so stop
+               tc_stop(&AVR32_TC, TC2_CHANNEL);
+               m2_curSpeed = kMinSpeed;
+               m2_running = 0;
+           } else {
+               // reverse direction at the slowest speed
+               m2_motorDir ^= 1;
+               if (m2_motorDir ^ sMotor[2].dirInv) {
+                   gpio_set_gpio_pin(sMotor[2].dir);
+               } else {
+                   gpio_clr_gpio_pin(sMotor[2].dir);
+               }
+           }
+       } else {
+           float dv = m2_curRC / m2_rampScl;    // speed change over this step
+           // slow down if we are going the wrong way, or if we need the
+           // remaining distance to decelerate to the minimum speed
+           if (dist <= 0 || spd * spd - (float)m2_minSpeed * m2_minSpeed >= 2.0f * m2_acc * (dist - 1)) {
+               spd -= dv;
+               if (spd < m2_minSpeed) spd = m2_minSpeed;
+           } else if (spd < m2_servoMax) {
+               spd += dv;
+               if (spd > m2_servoMax) spd = m2_servoMax;
+           } else if (spd > m2_servoMax) {
+               spd -= dv;
+               if (spd < m2_servoMax) spd = m2_servoMax;
+           }
+           m2_servoSpd = spd;
+           m2_curSpeed = (unsigned)spd;
+           m2_curRC = (unsigned)(kClockFreq / kPrescale / spd);
+           // set RA/RC for new frequency
+           tc_write_ra(&AVR32_TC, TC2_CHANNEL, m2_curRC >> 1);
+           tc_write_rc(&AVR32_TC, TC2_CHANNEL, m2_curRC);
+       }
+       U32 dur = Get_sys_count() - start;
+       ++m2_durHist[perf_bin(dur)];
+       if (dur > m2_durMax) m2_durMax = dur;
+       in = 0;
+       return;
+   }
+
    if (m2_rampFlag) {
        m2_stopFlag = m2_rampFlag;
        m2_rampFlag = 0;
@@ -712,9 +1245,6 @@ static void m2_irq(void)
            }
            m2_rampTime = 0;
            m2_ramping = 1;
-#ifdef DEBUG
-           m2_latency = 0;
-#endif
        }
 	} else if (m2_ramping) {
 	   m2_rampTime += m2_curRC;
@@ -738,199 +1268,1362 @@ static void m2_irq(void)
 	   // set RA/RC for new frequency
 	   tc_write_ra(&AVR32_TC, TC2_CHANNEL, m2_curRC >> 1);
 	   tc_write_rc(&AVR32_TC, TC2_CHANNEL, m2_curRC);
-#ifdef DEBUG
-	   unsigned int lat = tc_read_tc(&AVR32_TC, TC2_CHANNEL);
-	   if (lat > m2_latency) m2_latency = lat;
-#endif
 	}
 	
-#ifdef DEBUG
-	m2_lastCount = tc_read_tc(&AVR32_TC, TC2_CHANNEL);
-#endif
+    U32 dur = Get_sys_count() - start;
+    ++m2_durHist[perf_bin(dur)];
+    if (dur > m2_durMax) m2_durMax = dur;
     in = 0;
 }
 
 //-----------------------------------------------------------------------------
-void setPin(int n, int val)
+void setPin(int n, int val)
+{
+    if (output_mode[n] != 1) {
+        switch (output_mode[n]) {
+    	  case 3:
+    	    gpio_enable_gpio_pin(n);
+    	    // fall through!
+          case 2:
+    	    gpio_disable_pin_pull_up(n);
+    	    break;
+    	}
+        output_mode[n] = 1;
+    }
+    if (val) {
+        gpio_set_gpio_pin(n);
+    } else {
+        gpio_clr_gpio_pin(n);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void resurfacer_task_init(void)
+ {
+   sof_cnt = 0;
+   data_length = 0;
+   has_data = 0;
+   // the SOF interrupt wakes the main loop from sleep every millisecond
+   Usb_enable_sof_interrupt();
+ }
+
+//-----------------------------------------------------------------------------
+void usb_sof_action(void)
+{
+	sof_cnt++;
+	sched_flags |= EVT_SOF;
+}
+
+//-----------------------------------------------------------------------------
+// initialize the watchdog timer status LED
+void wdt_init(void)
+{
+#if defined(MANIP) || defined(CUTE)
+  if (AVR32_PM.RCAUSE.wdt) {
+      setPin(LED3_GPIO, 0); // turn on LED3
+  }
+#endif
+  wdt_disable();
+}
+
+//-----------------------------------------------------------------------------
+// PWM pulse generators
+//
+#define PWM_CPRE    AVR32_PWM_CPRE_MCK_DIV_256  // PWM channel prescaler
+#define PWM_CLK     (FPBA / 256)    // PWM clock rate Hz (234375 = 60MHz / 256)
+#define PWM_PULSE   10       // minimum pulse width (microseconds)
+#define PWM_WID     ((PWM_CLK * PWM_PULSE + 999999L) / 1000000L) // pulse width (clock ticks, must be less than kMinTop)
+
+#define TB_CHAN     5        // PWM channel for microsecond timebase (no output pin)
+#define TB_DIV      (FPBA / 1000000L)   // PWM clock A divider for 1 MHz timebase clock
+#define TB_PRD      1000     // timebase period (us)
+
+static pwm_opt_t pwm_opt = {
+    // PWM controller configuration.
+    .diva = TB_DIV,         // (clock A is used for the timebase)
+    .divb = AVR32_PWM_DIVB_CLK_OFF,
+    .prea = AVR32_PWM_PREA_MCK,
+    .preb = AVR32_PWM_PREB_MCK
+};
+static avr32_pwm_channel_t pwm_channel = {
+//    .CMR.calg = PWM_MODE_LEFT_ALIGNED,       // Channel mode.
+//    .CMR.cpol = PWM_POLARITY_LOW,            // Channel polarity.
+//    .CMR.cpd = PWM_UPDATE_PERIOD,            // Not used the first time.
+//    .CMR.cpre = PWM_CPRE,                    // Channel prescaler.
+    .cdty = PWM_WID,// Channel duty cycle, should be < CPRD (3 --> 12.8 microsec)
+    .cprd = 20,     // Channel period (set later)
+    .cupd = 0,      // Channel update is not used here
+    .ccnt = 0
+    // With these settings, the output waveform rate will be : (60000000/256)/20
+};
+
+// get index of PWM generator for a PWM channel number (-1 if not available)
+int pwm_index(int chan)
+{
+    int i;
+    for (i=0; i<NUM_PWMS; ++i) {
+        if (sPWM[i].channel == chan) return i;
+    }
+    return -1;
+}
+
+// stop PWM generator immediately
+// (may be called from the PWM interrupt)
+void pwm_halt(int i)
+{
+    int pin = sPWM[i].pin;
+    AVR32_PWM.idr = (1UL << sPWM[i].channel);  // stop counting pulses
+    pwm[i].ramping = 0;
+    if (!pwm[i].run) return;
+    // drive the output pin low
+    gpio_clr_gpio_pin(pin); // (set the pin low first to try to avoid a transient pulse)
+    gpio_enable_gpio_pin(pin);
+    gpio_clr_gpio_pin(pin); // (must clear pin again, since enable_gpio_pin apparently resets this)
+    output_mode[pin] = 1;
+    // stop the PWM
+    pwm_stop_channels(1UL << sPWM[i].channel);
+    pwm[i].run = 0;
+    pwm[i].spd = 0;
+}
+
+// run PWM generator at specified rate (0 = stop)
+void pwm_spd(int i, float rate)
+{
+    if (rate <= 0) {
+        pwm_halt(i);
+        return;
+    }
+	// (i can't figure out how to initialize these in the variable definition)
+    pwm_channel.CMR.calg = PWM_MODE_LEFT_ALIGNED;       // Channel mode.
+    pwm_channel.CMR.cpol = PWM_POLARITY_HIGH;           // Channel polarity.
+    pwm_channel.CMR.cpd  = PWM_UPDATE_PERIOD;           // Not used the first time.
+    pwm_channel.CMR.cpre = PWM_CPRE;                    // Channel prescaler.
+
+    // initialize the PWM if necessary
+    if (!pwm_flag) {
+        pwm_init(&pwm_opt);
+        pwm_flag = 1;
+    }
+    // calculate PWM period
+    unsigned long rcl = (unsigned long)(PWM_CLK / rate);
+    if (rcl > 0xfffff) rcl = 0xfffff;   // cprd is 20 bits
+    if (rcl < kMinTop) rcl = kMinTop;
+    pwm[i].rc = rcl;
+    pwm[i].spd = rate;
+    if (!pwm[i].run) {
+        int pin = sPWM[i].pin;
+        // init this channel and start the PWM
+        pwm_channel.cprd = rcl;
+        pwm_channel_init(sPWM[i].channel, &pwm_channel);
+        // enable PWM function pin if necessary
+        if (output_mode[pin] != 3) {
+            output_mode[pin] = 3;
+            gpio_enable_module_pin(pin, sPWM[i].function);
+        }
+        pwm[i].run = 1;
+        pwm_start_channels(1UL << sPWM[i].channel);  // start pwm
+    } else {
+        // already running, so just update the period
+        AVR32_PWM.channel[sPWM[i].channel].cupd = rcl; // (will update period on the next cycle)
+    }
+}
+
+// count PWM periods from the interrupt status flags of the counted channels
+static inline void pwm_period(U32 isr)
+{
+    int i;
+    if (isr & (1UL << TB_CHAN)) ++time_ms;
+    for (i=0; i<NUM_PWMS; ++i) {
+        if (!(isr & (1UL << sPWM[i].channel))) continue;
+        // one pulse is generated in each period
+        if (++pwm[i].count >= pwm[i].num) pwm_halt(i);
+    }
+}
+
+/*! \brief PWM interrupt (end of each period of the counted channels)
+ */
+__attribute__((__interrupt__))
+static void pwm_irq(void)
+{
+    // (reading the status register clears the interrupt flags)
+    pwm_period(AVR32_PWM.isr & AVR32_PWM.imr);
+}
+
+// start counting PWM pulses, stopping after the specified number (0 = don't count)
+void pwm_count(int i, long num)
+{
+    U32 bit = 1UL << sPWM[i].channel;
+    Disable_global_interrupt();
+    AVR32_PWM.idr = bit;
+    // clear any stale period flag for this channel (reading the status
+    // register clears all flags, so count the other channels now)
+    pwm_period(AVR32_PWM.isr & AVR32_PWM.imr);
+    pwm[i].count = 0;
+    pwm[i].num = num;
+    if (num) AVR32_PWM.ier = bit;
+    Enable_global_interrupt();
+}
+
+// start the microsecond timebase
+// (PWM5 counts 1 MHz clock A ticks, and interrupts once per millisecond)
+void time_init(void)
+{
+    avr32_pwm_channel_t tb_channel = {
+        .cdty = TB_PRD / 2,
+        .cprd = TB_PRD,
+        .cupd = 0,
+        .ccnt = 0
+    };
+    tb_channel.CMR.calg = PWM_MODE_LEFT_ALIGNED;
+    tb_channel.CMR.cpol = PWM_POLARITY_HIGH;
+    tb_channel.CMR.cpd  = PWM_UPDATE_PERIOD;
+    tb_channel.CMR.cpre = AVR32_PWM_CPRE_CLKA;
+    if (!pwm_flag) {
+        pwm_init(&pwm_opt);
+        pwm_flag = 1;
+    }
+    pwm_channel_init(TB_CHAN, &tb_channel);
+    pwm_start_channels(1UL << TB_CHAN);
+    AVR32_PWM.ier = (1UL << TB_CHAN);
+}
+
+// get the timebase time in microseconds
+// (may be called with interrupts disabled, or from an interrupt)
+U64 time_us(void)
+{
+    int en = Is_global_interrupt_enabled();
+    Disable_global_interrupt();
+    U32 cnt = AVR32_PWM.channel[TB_CHAN].ccnt;
+    // service any pending PWM period interrupt so time_ms is up to date
+    pwm_period(AVR32_PWM.isr & AVR32_PWM.imr);
+    U32 cnt2 = AVR32_PWM.channel[TB_CHAN].ccnt;
+    // the period ended while we were reading, either before the interrupt
+    // flags were read (already counted above) or after (flag now pending),
+    // so service the flags again to count it exactly once
+    if (cnt2 < cnt) pwm_period(AVR32_PWM.isr & AVR32_PWM.imr);
+    U32 ms = time_ms;
+    if (en) Enable_global_interrupt();
+    return (U64)ms * TB_PRD + cnt2;
+}
+
+// add " T=SEC.USEC" timestamp to a string
+// Returns: number of characters added
+int sprint_time(char *buf, U64 us)
+{
+    return sprintf(buf, " T=%lu.%06lu", (unsigned long)(us / 1000000UL),
+                   (unsigned long)(us % 1000000UL));
+}
+
+// ramp PWM generator speeds (called from main loop once per USB frame)
+void pwm_task(void)
+{
+    int i;
+
+    for (i=0; i<NUM_PWMS; ++i) {
+        if (!pwm[i].ramping) continue;
+        if (!pwm[i].run) {
+            pwm[i].ramping = 0;     // (stopped by pulse count)
+            continue;
+        }
+        float target = pwm[i].target;
+        float spd = pwm[i].spd;
+        float dv = pwm[i].acc / 1000.0;
+        if (pwm[i].num) {
+            // start ramping down in time to reach the minimum speed at the last pulse
+            long left = pwm[i].num - pwm[i].count;
+            float decel = (spd * spd - (float)kPwmMinSpeed * kPwmMinSpeed) / (2.0 * pwm[i].acc);
+            if (left <= decel + spd / 1000.0) target = kPwmMinSpeed;
+        }
+        if (spd < target) {
+            spd += dv;
+            if (spd > target) spd = target;
+        } else if (spd > target) {
+            spd -= dv;
+            if (spd < target) spd = target;
+        }
+        if (spd < kPwmMinSpeed) {
+            if (!pwm[i].target) {
+                pwm_halt(i);        // ramped down to a stop
+                continue;
+            }
+            spd = kPwmMinSpeed;
+        }
+        Disable_global_interrupt();
+        if (pwm[i].run) pwm_spd(i, spd);    // (unless the last pulse was just counted)
+        Enable_global_interrupt();
+        // done ramping when we reach the target (but keep going to ramp down for the count)
+        if (spd == pwm[i].target && !pwm[i].num) pwm[i].ramping = 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// activate the watchdog timer
+void wdt_scheduler(void)
+{
+  // If Reset Cause is due to a Watchdog reset just relaunch Watchdog and turn
+  // on LED3 on to let user know that a new wdt reset has occured (MANIP/CUTE only).
+  if (AVR32_PM.RCAUSE.wdt) {
+      wdt_reenable();
+      wdt_flag = 2;
+  // If Reset Cause is due to a Power On or external reset...
+//  } else if (AVR32_PM.RCAUSE.por || AVR32_PM.RCAUSE.ext) {
+  } else {
+      // Save current value in GPLP register (preserved across reset)
+    //  pm_write_gplp(&AVR32_PM,0,current_wdt_value);
+      // enable the watchdog timer
+      wdt_enable(current_wdt_value);
+      wdt_flag = 1;
+  }
+}
+
+// read comma-separated channels from string
+// returns error string, or NULL on success
+char *getValues(int *chan, char *str, int num, int max)
+{
+    int i,j,n;
+    for (i=0,j=0,n=0; ; ++j) {
+        char ch = str[j];
+        if (ch == ',' || !ch) {
+            if (n >= max) return "value out of range";
+            if (i >= num) return "too many channels";
+            chan[i++] = n;
+            n = 0;
+            if (!ch) break;
+        } else if (ch >= '0' && ch <= '9') {
+            n = 10 * n + ch - '0';
+        } else {
+            return "invalid channel";
+        }
+    }
+    return NULL;
+}
+
+#if defined(MANIP) || defined(CUTE)
+// convert the configured delays to CPU cycles
+// (must be called whenever cfg_del changes)
+void set_delays(void)
+{
+    int i;
+    for (i=0; i<kNumDelay; ++i) {
+        del_cy[i] = NS_TO_CY(cfg_del[i]);
+    }
+}
+
+// delay for the configured number of nanoseconds
+// (timed with the CPU COUNT register, so it doesn't depend on compiler
+//  optimization, but an interrupt may stretch it -- this is a minimum)
+void delay(int del_num)
+{
+    if (del_num < kNumDelay) {
+        U32 start = Get_sys_count();
+        U32 cy = del_cy[del_num];
+        while ((U32)(Get_sys_count() - start) < cy) ;
+    }
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// add a response line to the output buffer
+// Inputs: idx=command index (or '\0' for none), ok=flag for OK response, msg=message
+// Returns: non-zero if the response was added, or 0 if there was no room
+int add_response(char idx, int ok, char *msg)
+{
+    static char full = 0;
+    int n = strlen(msg);
+    // (save room for "X.BAD " header and "\0" terminator)
+    if (data_length + n + 7 >= OUT_SIZE) {
+        // log only the first of a run of overflows (events are often retried)
+        if (!full) log_add(LOG_FULL, idx, n, NULL);
+        full = 1;
+        return 0;
+    }
+    full = 0;
+    // prefix response with command index if provided
+    if (idx) {
+       out_buff[data_length++] = idx;
+       out_buff[data_length++] = '.';
+    }
+    if (ok) {
+       strcpy(out_buff + data_length, "OK");  data_length += 2;
+    } else {
+       strcpy(out_buff + data_length, "BAD"); data_length += 3;
+    }
+    if (n) {
+       out_buff[data_length++] = ' ';
+       memcpy(out_buff + data_length, msg, n);  data_length += n;
+    }
+    out_buff[data_length++] = '\n';
+    out_buff[data_length] = '\0';  // null-terminate response
+    has_data = 1;
+    return 1;
+}
+
+//-----------------------------------------------------------------------------
+// parse a channel range of the form "pa#[-#]" or "pb#[-#]"
+// Inputs: str=string to parse, n/n2=returned first/last channel numbers (PB = 32-43)
+// Returns: error string, or NULL on success
+char *getRange(char *str, int *n, int *n2)
+{
+    int i = 2;
+    if (str[0] != 'p' || (str[1] != 'a' && str[1] != 'b') || !isdigit(str[2])) {
+        return "invalid channel";
+    }
+    *n = *n2 = atoi(str + 2);
+    while (isdigit(str[i])) ++i;
+    if (str[i] == '-') {
+        if (!isdigit(str[++i])) return "invalid channel";
+        *n2 = atoi(str + i);
+        while (isdigit(str[i])) ++i;
+    }
+    if (str[i]) return "invalid channel";
+    if (str[1] == 'b') { *n += 32; *n2 += 32; }
+    if (*n >= IO_CHANNELS || *n2 >= IO_CHANNELS) return "channel out of range";
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// scan watched GPIO channels and push an event for each change
+void watch_task(void)
+{
+    char msg[48];
+    int port, bit, n;
+
+    for (port=0; port<2; ++port) {
+        U32 mask = watch_mask[port];
+        if (!mask) continue;
+        U32 val = AVR32_GPIO.port[port].pvr;
+        U32 chg = (val ^ watch_last[port]) & mask;
+        if (!chg) continue;
+        U64 t = time_us();
+        watch_last[port] = val;
+        for (bit=0; chg; ++bit, chg>>=1) {
+            if (!(chg & 0x01)) continue;
+            n = sprintf(msg, "W p%c%d=%d", 'a' + port, bit, (int)((val >> bit) & 0x01));
+            sprint_time(msg + n, t);
+            if (!add_response(EVT_ID, 1, msg)) ++watch_lost;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// get the current position of a motor
+long motor_pos(int mot_num)
+{
+    switch (mot_num) {
+      case 0:
+        return m0_motorPos;
+      case 1:
+        return m1_motorPos;
+      default:
+        return m2_motorPos;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// check to see if a motor is running
+int motor_moving(int mot_num)
+{
+    switch (mot_num) {
+      case 0:
+        return m0_running && m0_motorOn;
+      case 1:
+        return m1_running && m1_motorOn;
+      default:
+        return m2_running && m2_motorOn;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// leave position servo mode (the motor continues at its current speed)
+void servo_off(int mot_num)
+{
+    switch (mot_num) {
+      case 0:
+        m0_servo = 0;
+        break;
+      case 1:
+        m1_servo = 0;
+        break;
+      case 2:
+        m2_servo = 0;
+        break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// set the position servo target, entering servo mode if necessary
+// Inputs: pos=target position, spd=maximum speed (steps/sec)
+// Returns: error string, or NULL on success
+char *servo_goto(int mot_num, long pos, unsigned spd)
+{
+    switch (mot_num) {
+      case 0:
+        if (!m0_motorOn) return "m0 is not on";
+        Disable_global_interrupt();
+        m0_servoTo = pos;
+        m0_servoMax = spd;
+        if (!m0_servo) {
+            // take over from any ramp in progress at the current speed
+            m0_stepMode = 0;
+            m0_rampFlag = 0;
+            m0_ramping = 0;
+            m0_servoSpd = m0_running ? m0_curSpeed : m0_minSpeed;
+            m0_servo = 1;
+        }
+        if (!m0_running && pos != m0_motorPos) {
+            // start moving toward the target at the minimum speed
+            m0_motorDir = (pos < m0_motorPos);
+            setPin(sMotor[0].dir, m0_motorDir ^ sMotor[0].dirInv);
+            m0_servoSpd = m0_minSpeed;
+            m0_curRC = (unsigned)(kClockFreq / (kPrescale * (long)m0_minSpeed));
+            tc_write_ra(&AVR32_TC, TC0_CHANNEL, m0_curRC >> 1);
+            tc_write_rc(&AVR32_TC, TC0_CHANNEL, m0_curRC);
+            m0_running = 1;
+            tc_start(&AVR32_TC, TC0_CHANNEL);   // Start the timer/counter
+        }
+        Enable_global_interrupt();
+        break;
+      case 1:
+        if (!m1_motorOn) return "m1 is not on";
+        Disable_global_interrupt();
+        m1_servoTo = pos;
+        m1_servoMax = spd;
+        if (!m1_servo) {
+            // take over from any ramp in progress at the current speed
+            m1_rampFlag = 0;
+            m1_ramping = 0;
+            m1_servoSpd = m1_running ? m1_curSpeed : m1_minSpeed;
+            m1_servo = 1;
+        }
+        if (!m1_running && pos != m1_motorPos) {
+            // start moving toward the target at the minimum speed
+            m1_motorDir = (pos < m1_motorPos);
+            setPin(sMotor[1].dir, m1_motorDir ^ sMotor[1].dirInv);
+            m1_servoSpd = m1_minSpeed;
+            m1_curRC = (unsigned)(kClockFreq / (kPrescale * (long)m1_minSpeed));
+            tc_write_ra(&AVR32_TC, TC1_CHANNEL, m1_curRC >> 1);
+            tc_write_rc(&AVR32_TC, TC1_CHANNEL, m1_curRC);
+            m1_running = 1;
+            tc_start(&AVR32_TC, TC1_CHANNEL);   // Start the timer/counter
+        }
+        Enable_global_interrupt();
+        break;
+      case 2:
+        if (!m2_motorOn) return "m2 is not on";
+        Disable_global_interrupt();
+        m2_servoTo = pos;
+        m2_servoMax = spd;
+        if (!m2_servo) {
+            // take over from any ramp in progress at the current speed
+            m2_rampFlag = 0;
+            m2_ramping = 0;
+            m2_servoSpd = m2_running ? m2_curSpeed : m2_minSpeed;
+            m2_servo = 1;
+        }
+        if (!m2_running && pos != m2_motorPos) {
+            // start moving toward the target at the minimum speed
+            m2_motorDir = (pos < m2_motorPos);
+            setPin(sMotor[2].dir, m2_motorDir ^ sMotor[2].dirInv);
+            m2_servoSpd = m2_minSpeed;
+            m2_curRC = (unsigned)(kClockFreq / (kPrescale * (long)m2_minSpeed));
+            tc_write_ra(&AVR32_TC, TC2_CHANNEL, m2_curRC >> 1);
+            tc_write_rc(&AVR32_TC, TC2_CHANNEL, m2_curRC);
+            m2_running = 1;
+            tc_start(&AVR32_TC, TC2_CHANNEL);   // Start the timer/counter
+        }
+        Enable_global_interrupt();
+        break;
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// stop a motor by ramping down to the minimum speed (same as "m# stop")
+void motor_stop(int mot_num)
+{
+    servo_off(mot_num);
+    unsigned speed;
+    unsigned long rcl;
+
+    switch (mot_num) {
+      case 0:
+        if (!m0_running) break;
+        m0_stepMode = 0;
+        speed = m0_curSpeed < m0_minSpeed ? m0_curSpeed : m0_minSpeed;
+        rcl = m0_actClock / speed;
+        if (rcl > 0xffff) rcl = 0xffff;
+        if (rcl < kMinTop) rcl = kMinTop;
+        m0_rampTo = (unsigned int)rcl;
+        m0_rampFlag = 2;
+        break;
+      case 1:
+        if (!m1_running) break;
+        speed = m1_curSpeed < m1_minSpeed ? m1_curSpeed : m1_minSpeed;
+        rcl = m1_actClock / speed;
+        if (rcl > 0xffff) rcl = 0xffff;
+        if (rcl < kMinTop) rcl = kMinTop;
+        m1_rampTo = (unsigned int)rcl;
+        m1_rampFlag = 2;
+        break;
+      case 2:
+        if (!m2_running) break;
+        speed = m2_curSpeed < m2_minSpeed ? m2_curSpeed : m2_minSpeed;
+        rcl = m2_actClock / speed;
+        if (rcl > 0xffff) rcl = 0xffff;
+        if (rcl < kMinTop) rcl = kMinTop;
+        m2_rampTo = (unsigned int)rcl;
+        m2_rampFlag = 2;
+        break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// halt a motor immediately (same as "m# halt")
+void motor_halt(int mot_num)
+{
+    servo_off(mot_num);
+    switch (mot_num) {
+      case 0:
+        m0_rampTo = (unsigned int)(m0_actClock / m0_minSpeed);
+        m0_rampFlag = 3;
+        break;
+      case 1:
+        m1_rampTo = (unsigned int)(m1_actClock / m1_minSpeed);
+        m1_rampFlag = 3;
+        break;
+      case 2:
+        m2_rampTo = (unsigned int)(m2_actClock / m2_minSpeed);
+        m2_rampFlag = 3;
+        break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// ramp a stopped motor up to the specified speed in the specified direction
+// (same as "m# dir DIR" followed by "m# ramp SPD")
+// Returns: error string, or NULL on success
+char *motor_ramp(int mot_num, int dir, int speed)
+{
+    unsigned long rcl;
+    unsigned int rc;
+
+    if (motor_moving(mot_num)) return "motor is running";
+    servo_off(mot_num);
+    switch (mot_num) {
+      case 0:
+        if (!m0_motorOn) return "m0 is not on";
+        m0_stepMode = 0;
+        m0_motorDir = dir;
+        setPin(sMotor[0].dir, m0_motorDir ^ sMotor[0].dirInv);
+        rcl = m0_actClock / speed;
+        if (rcl > 0xffff) rcl = 0xffff;
+        rc = (unsigned int)rcl;
+        if (rc < kMinTop) rc = kMinTop;
+        m0_rampTo = rc;
+        m0_rampFlag = 1;
+        if (!m0_running) {
+            m0_running = 1;
+            tc_start(&AVR32_TC, TC0_CHANNEL);   // Start the timer/counter
+        }
+        break;
+      case 1:
+        if (!m1_motorOn) return "m1 is not on";
+        m1_motorDir = dir;
+        setPin(sMotor[1].dir, m1_motorDir ^ sMotor[1].dirInv);
+        rcl = m1_actClock / speed;
+        if (rcl > 0xffff) rcl = 0xffff;
+        rc = (unsigned int)rcl;
+        if (rc < kMinTop) rc = kMinTop;
+        m1_rampTo = rc;
+        m1_rampFlag = 1;
+        if (!m1_running) {
+            m1_running = 1;
+            tc_start(&AVR32_TC, TC1_CHANNEL);   // Start the timer/counter
+        }
+        break;
+      case 2:
+        if (!m2_motorOn) return "m2 is not on";
+        m2_motorDir = dir;
+        setPin(sMotor[2].dir, m2_motorDir ^ sMotor[2].dirInv);
+        rcl = m2_actClock / speed;
+        if (rcl > 0xffff) rcl = 0xffff;
+        rc = (unsigned int)rcl;
+        if (rc < kMinTop) rc = kMinTop;
+        m2_rampTo = rc;
+        m2_rampFlag = 1;
+        if (!m2_running) {
+            m2_running = 1;
+            tc_start(&AVR32_TC, TC2_CHANNEL);   // Start the timer/counter
+        }
+        break;
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// set motor acceleration (steps/sec/sec)
+void motor_setAcc(int mot_num, unsigned acc)
+{
+    switch (mot_num) {
+      case 0:
+        m0_acc = acc;
+        m0_rampScl = (float)(kClockFreq / kPrescale) / acc;
+        break;
+      case 1:
+        m1_acc = acc;
+        m1_rampScl = (float)(kClockFreq / kPrescale) / acc;
+        break;
+      case 2:
+        m2_acc = acc;
+        m2_rampScl = (float)(kClockFreq / kPrescale) / acc;
+        break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// get checksum of the preserved motor state
+U32 state_checksum(void)
+{
+    U32 sum = kStateMagic + sizeof(sState);
+    U32 *pt = (U32 *)&sState;
+    int i;
+    for (i=0; i<sizeof(sState)/sizeof(U32); ++i) {
+        sum = ((sum << 1) | (sum >> 31)) ^ pt[i];
+    }
+    return sum;
+}
+
+//-----------------------------------------------------------------------------
+// save motor state to RAM that is preserved across resets (called once per ms)
+// (the checksum goes in the GPLP0 register, which also survives a reset)
+void state_task(void)
+{
+    int i;
+    sState.moving = 0;
+    for (i=0; i<NUM_MOTORS; ++i) {
+        sState.pos[i] = motor_pos(i);
+        sState.dirInv[i] = sMotor[i].dirInv;
+        sState.onInv[i] = sMotor[i].onInv;
+        if (motor_moving(i)) sState.moving |= (1 << i);
+    }
+    sState.dir[0] = m0_motorDir;  sState.acc[0] = m0_acc;
+    sState.dir[1] = m1_motorDir;  sState.acc[1] = m1_acc;
+    sState.dir[2] = m2_motorDir;  sState.acc[2] = m2_acc;
+    pm_write_gplp(&AVR32_PM, 0, state_checksum());
+}
+
+//-----------------------------------------------------------------------------
+// restore motor state after a reset (call before initializing the motor outputs)
+// (the motors are left off, since we don't know why we were reset)
+// Returns: 0 if no state was restored, 1 if restored, or 2 if restored but
+//          a motor was moving (so its position may be off by a few steps)
+int state_restore(void)
+{
+    int i;
+    // (RAM contents are lost on power up, and the checksum should catch this
+    //  anyway, but don't take any chances)
+    if (AVR32_PM.RCAUSE.por || pm_read_gplp(&AVR32_PM, 0) != state_checksum()) return 0;
+    m0_motorPos = sState.pos[0];  m0_motorDir = sState.dir[0];
+    m1_motorPos = sState.pos[1];  m1_motorDir = sState.dir[1];
+    m2_motorPos = sState.pos[2];  m2_motorDir = sState.dir[2];
+    for (i=0; i<NUM_MOTORS; ++i) {
+        sMotor[i].dirInv = sState.dirInv[i];
+        sMotor[i].onInv = sState.onInv[i];
+        if (sState.acc[i] >= kMotorAccMin && sState.acc[i] <= kMotorAccMax) {
+            motor_setAcc(i, sState.acc[i]);
+        }
+#if defined(MANIP) || defined(CUTE)
+        // (encoder monitors aren't normally enabled yet, but keep them in step)
+        if (sEnc[i].brd >= 0) encoder_ref(i);
+#endif
+    }
+    return sState.moving ? 2 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// load configuration saved in the flash user page (if any)
+void config_load(void)
+{
+    const sConfig *cfg = (const sConfig *)AVR32_FLASHC_USER_PAGE;
+    int i;
+    if (cfg->magic != kConfigMagic) return;
+    for (i=0; i<NUM_MOTORS; ++i) {
+        sMotor[i].dirInv = cfg->dirInv[i];
+        sMotor[i].onInv = cfg->onInv[i];
+        if (cfg->acc[i] >= kMotorAccMin && cfg->acc[i] <= kMotorAccMax) {
+            motor_setAcc(i, cfg->acc[i]);
+        }
+    }
+#if defined(MANIP) || defined(CUTE)
+    memcpy(cfg_adr, cfg->adr, sizeof(cfg_adr));
+    memcpy(cfg_dat, cfg->dat, sizeof(cfg_dat));
+    memcpy(cfg_del, cfg->del, sizeof(cfg_del));
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// save the current configuration to the flash user page (or erase it if save=0)
+void config_save(int save)
+{
+    sConfig cfg;
+    int i;
+    memset(&cfg, 0, sizeof(cfg));
+    if (save) {
+        cfg.magic = kConfigMagic;
+        for (i=0; i<NUM_MOTORS; ++i) {
+            cfg.dirInv[i] = sMotor[i].dirInv;
+            cfg.onInv[i] = sMotor[i].onInv;
+        }
+        cfg.acc[0] = m0_acc;
+        cfg.acc[1] = m1_acc;
+        cfg.acc[2] = m2_acc;
+#if defined(MANIP) || defined(CUTE)
+        memcpy(cfg.adr, cfg_adr, sizeof(cfg_adr));
+        memcpy(cfg.dat, cfg_dat, sizeof(cfg_dat));
+        memcpy(cfg.del, cfg_del, sizeof(cfg_del));
+#endif
+    }
+    // (flashc_memcpy preserves the rest of the user page, including the
+    //  bootloader configuration words at the end)
+    flashc_memcpy(AVR32_FLASHC_USER_PAGE, &cfg, sizeof(cfg), TRUE);
+}
+
+//-----------------------------------------------------------------------------
+// enable an internal ADC channel and its pin if not done already
+void adc_chan_enable(int n)
+{
+    short pin = sADC[n].pin;
+    if (output_mode[pin] != 3) {
+        gpio_enable_module_pin(pin, sADC[n].function);
+        adc_enable(&AVR32_ADC, sADC[n].channel);
+        output_mode[pin] = 3;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// re-arm the motor triggers after the trigger list or motor position changes
+void trig_reset(int mot_num)
+{
+    Disable_global_interrupt();
+    trig_fire(mot_num, motor_pos(mot_num), 0);
+    Enable_global_interrupt();
+}
+
+//-----------------------------------------------------------------------------
+// set the motor position, and re-arm the triggers and encoder monitor to match
+void motor_setPos(int mot_num, long pos)
+{
+    switch (mot_num) {
+      case 0:
+        m0_motorPos = pos;
+        break;
+      case 1:
+        m1_motorPos = pos;
+        break;
+      case 2:
+        m2_motorPos = pos;
+        break;
+    }
+    trig_reset(mot_num);
+#if defined(MANIP) || defined(CUTE)
+    if (sEnc[mot_num].brd >= 0) encoder_ref(mot_num);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// add a motor position trigger
+// Inputs: pos=motor position, act=action ("pa#=0", "pa#=1", "pb#=0", "pb#=1", "adc#" or "log")
+// Returns: error string, or NULL on success
+char *trig_add(int mot_num, long pos, char *act)
+{
+    int action, chan = 0, i;
+
+    if (!strcmp(act,"log")) {
+        action = TRIG_LOG;
+    } else if (!strncmp(act,"adc",3) && act[3]>='0' && act[3]-'0'<NUM_ADCS && !act[4]) {
+        action = TRIG_ADC;
+        chan = act[3] - '0';
+    } else {
+        char *pt = strchr(act, '=');
+        if (!pt || (pt[1] != '0' && pt[1] != '1') || pt[2]) return "invalid action";
+        action = (pt[1] == '1' ? TRIG_SET : TRIG_CLR);
+        *pt = '\0';
+        char *err = getRange(act, &chan, &i);
+        if (err) return err;
+        if (i != chan) return "invalid channel";
+    }
+    if (trig_num[mot_num] >= kMaxTrig) return "too many triggers";
+    if (action == TRIG_ADC) adc_chan_enable(chan);
+    // insert into the sorted list and re-arm
+    Disable_global_interrupt();
+    for (i=trig_num[mot_num]; i>0 && trig[mot_num][i-1].pos > pos; --i) {
+        trig[mot_num][i] = trig[mot_num][i-1];
+    }
+    trig[mot_num][i].pos = pos;
+    trig[mot_num][i].action = action;
+    trig[mot_num][i].chan = chan;
+    ++trig_num[mot_num];
+    trig_fire(mot_num, motor_pos(mot_num), 0);
+    Enable_global_interrupt();
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// remove all motor triggers, or just the ones at the specified position
+void trig_clear(int mot_num, int all, long pos)
+{
+    int i, j;
+    Disable_global_interrupt();
+    for (i=0, j=0; i<trig_num[mot_num]; ++i) {
+        if (all || trig[mot_num][i].pos == pos) continue;
+        trig[mot_num][j++] = trig[mot_num][i];
+    }
+    trig_num[mot_num] = j;
+    trig_fire(mot_num, motor_pos(mot_num), 0);
+    Enable_global_interrupt();
+}
+
+//-----------------------------------------------------------------------------
+// push events for fired ADC and log triggers
+void trig_task(void)
+{
+    char msg[64];
+
+    while (trig_tail != trig_head) {
+        int mot = trig_evt[trig_tail].mot;
+        long pos = trig_evt[trig_tail].pos;
+        U64 t = trig_evt[trig_tail].time;
+        int n;
+        if (trig_evt[trig_tail].action == TRIG_ADC) {
+            int chan = trig_evt[trig_tail].chan;
+            // convert now (only once, in case we have to retry sending the event)
+            if (trig_evt[trig_tail].val < 0) {
+                if (adc_check_eoc(&AVR32_ADC, sADC[chan].channel) == HIGH) {
+                    adc_get_value(&AVR32_ADC, sADC[chan].channel);  // (discard old value)
+                }
+                adc_start(&AVR32_ADC);
+                trig_evt[trig_tail].val = adc_get_value(&AVR32_ADC, sADC[chan].channel);
+            }
+            n = sprintf(msg, "m%d TRIG POS=%ld adc%d=%d", mot, pos, chan,
+                        trig_evt[trig_tail].val);
+        } else {
+            n = sprintf(msg, "m%d TRIG POS=%ld", mot, pos);
+        }
+        sprint_time(msg + n, t);
+        if (!add_response(EVT_ID, 1, msg)) break;   // (try again when there is room)
+        trig_tail = (trig_tail + 1) & (kTrigQueue - 1);
+    }
+}
+
+//-----------------------------------------------------------------------------
+/*! \brief GPIO interrupt for limit switches (latches motor position for homing)
+ */
+__attribute__((__interrupt__))
+static void home_irq(void)
+{
+    int i;
+    for (i=0; i<NUM_MOTORS; ++i) {
+        int pin = home[i].pin;
+        if (home[i].state != HOME_APPROACH || !gpio_get_pin_interrupt_flag(pin)) continue;
+        home[i].latch = motor_pos(i);
+        home[i].latched = 1;
+        gpio_disable_pin_interrupt(pin);
+        gpio_clear_pin_interrupt_flag(pin);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// start homing a motor
+// Inputs: dir=direction of limit switch (0=+ve, 1=-ve), fast=seek speed,
+//         slow=approach speed, backoff=back off distance, ofs=position at switch
+// Returns: error string, or NULL on success
+char *home_start(int mot_num, int dir, int fast, int slow, long backoff, long ofs)
+{
+    int pin = dir ? sLimit[mot_num].lo : sLimit[mot_num].hi;
+    if (pin < 0) return "no limit switch";
+    if (motor_moving(mot_num)) return "motor is running";
+    // configure the limit switch as an input with pull-up
+    if (output_mode[pin] != 2) {
+        gpio_enable_gpio_pin(pin);
+        gpio_local_disable_pin_output_driver(pin);
+        gpio_enable_pin_pull_up(pin);
+        output_mode[pin] = 2;
+    }
+    home[mot_num].dir = dir;
+    home[mot_num].pin = pin;
+    home[mot_num].fast = fast;
+    home[mot_num].slow = slow;
+    home[mot_num].backoff = backoff;
+    home[mot_num].ofs = ofs;
+    home[mot_num].latched = 0;
+    if (!gpio_get_pin_value(pin)) {
+        // already at the switch, so start by backing off
+        home[mot_num].state = HOME_STOP1;
+        return NULL;
+    }
+    home[mot_num].state = HOME_SEEK;
+    char *err = motor_ramp(mot_num, dir, fast);
+    if (err) home[mot_num].state = HOME_IDLE;
+    return err;
+}
+
+//-----------------------------------------------------------------------------
+// abort homing (the motor is left running)
+void home_abort(int mot_num)
+{
+    if (home[mot_num].state == HOME_APPROACH) gpio_disable_pin_interrupt(home[mot_num].pin);
+    home[mot_num].state = HOME_IDLE;
+}
+
+//-----------------------------------------------------------------------------
+// step the homing state machines (called from main loop once per ms)
+void home_task(void)
+{
+    char msg[64];
+    int i;
+
+    for (i=0; i<NUM_MOTORS; ++i) {
+        if (!home[i].state) continue;
+        int pin = home[i].pin;
+        int hit = !gpio_get_pin_value(pin);
+        int moving = motor_moving(i);
+        char *err = NULL;
+        long pos = motor_pos(i);
+        switch (home[i].state) {
+          case HOME_SEEK:
+            if (hit) {
+                motor_halt(i);
+                home[i].state = HOME_STOP1;
+            } else if (!moving) {
+                err = "stopped";
+            }
+            break;
+          case HOME_STOP1:
+            if (moving) break;
+            home[i].released = 0;
+            err = motor_ramp(i, !home[i].dir, home[i].slow);
+            home[i].state = HOME_BACKOFF;
+            break;
+          case HOME_BACKOFF:
+            if (!moving) {
+                err = "stopped";
+            } else if (!home[i].released) {
+                if (!hit) {
+                    home[i].released = 1;
+                    home[i].release = pos;
+                }
+            } else if (labs(pos - home[i].release) >= home[i].backoff) {
+                motor_halt(i);
+                home[i].state = HOME_STOP2;
+            }
+            break;
+          case HOME_STOP2:
+            if (moving) break;
+            if (hit) {
+                err = "switch didn't release";
+                break;
+            }
+            // arm the limit switch interrupt (switch is active low)
+            home[i].latched = 0;
+            gpio_clear_pin_interrupt_flag(pin);
+            gpio_enable_pin_interrupt(pin, GPIO_FALLING_EDGE);
+            home[i].state = HOME_APPROACH;
+            err = motor_ramp(i, home[i].dir, home[i].slow);
+            break;
+          case HOME_APPROACH:
+            if (home[i].latched) {
+                motor_halt(i);
+                home[i].state = HOME_STOP3;
+            } else if (!moving) {
+                err = "stopped";
+            }
+            break;
+          case HOME_STOP3:
+            if (moving) break;
+            // set the position relative to where the switch changed
+            pos = home[i].ofs + (pos - home[i].latch);
+            motor_setPos(i, pos);
+            home[i].state = HOME_IDLE;
+            sprintf(msg, "m%d HOME POS=%ld", i, pos);
+            add_response(EVT_ID, 1, msg);
+            log_add(LOG_HOME, i, pos, NULL);
+            break;
+        }
+        if (err) {
+            home_abort(i);
+            motor_halt(i);
+            sprintf(msg, "m%d HOME FAILED (%s)", i, err);
+            add_response(EVT_ID, 1, msg);
+            log_add(LOG_STOP, i, pos, err);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// stop moving motors that haven't received a command within their heartbeat timeout
+// (called from main loop once per ms)
+void hb_task(void)
 {
-    if (output_mode[n] != 1) {
-        switch (output_mode[n]) {
-    	  case 3:
-    	    gpio_enable_gpio_pin(n);
-    	    // fall through!
-          case 2:
-    	    gpio_disable_pin_pull_up(n);
-    	    break;
-    	}
-        output_mode[n] = 1;
-    }
-    if (val) {
-        gpio_set_gpio_pin(n);
-    } else {
-        gpio_clr_gpio_pin(n);
+    char msg[64];
+    int i;
+
+    for (i=0; i<NUM_MOTORS; ++i) {
+        if (!hb_ms[i] || hb_tripped[i] || !motor_moving(i)) continue;
+        if (time_ms - hb_last[i] <= hb_ms[i]) continue;
+        long pos = motor_pos(i);
+        home_abort(i);
+        motor_stop(i);      // (ramp down, but don't stop the other motors)
+        hb_tripped[i] = 1;
+        sprintf(msg, "m%d HB STOP POS=%ld", i, pos);
+        add_response(EVT_ID, 1, msg);
+        log_add(LOG_STOP, i, pos, "heartbeat");
     }
 }
 
+#if defined(MANIP) || defined(CUTE)
 //-----------------------------------------------------------------------------
-void resurfacer_task_init(void)
- {
-   sof_cnt = 0;
-   data_length = 0;
-   has_data = 0;
- 	  // Don't need this - PH
- 	  //Usb_enable_sof_interrupt();
- }
+// read Steve's 16-bit encoder counter
+// Inputs: brd=board number (0-3)
+unsigned read_counter(int brd)
+{
+    unsigned count = 0;
+    int i;
+    setPin(DEV0, 1);    // device 1
+    setPin(BRD0, brd & 0x01); // address the board
+    setPin(BRD1, brd & 0x02);
+    setPin(BRDSEL, 1);  // select the board
+    setPin(XRD, 0);     // read data
+    delay(0);           // wait for data to stabilize
+    // read high byte
+    for (i=0; i<kNumDatLines; ++i) {
+        count |= (gpio_get_pin_value(cfg_dat[i]) << (8+i));
+    }
+    setPin(BYSEL, 1);   // select low byte
+    delay(1);           // wait for data to stabilize
+    // read low byte
+    for (i=0; i<kNumDatLines; ++i) {
+        count |= (gpio_get_pin_value(cfg_dat[i]) << i);
+    }
+    // return outputs to their defaults
+    setPin(XRD, 1);     // completes the inihibit logic
+    setPin(BRDSEL, 0);
+    setPin(DEV0, 0);
+    setPin(BYSEL, 0);
+    return count;
+}
 
 //-----------------------------------------------------------------------------
-void usb_sof_action(void)
+// reset the encoder reference to the current motor and encoder positions
+void encoder_ref(int mot_num)
 {
-	sof_cnt++;
+    sEnc[mot_num].last = (U16)read_counter(sEnc[mot_num].brd);
+    sEnc[mot_num].count = 0;
+    sEnc[mot_num].ref = motor_pos(mot_num);
+    sEnc[mot_num].stallPos = sEnc[mot_num].ref;
+    sEnc[mot_num].err = 0;
+    sEnc[mot_num].tripped = 0;
 }
 
 //-----------------------------------------------------------------------------
-// initialize the watchdog timer status LED
-void wdt_init(void)
+// sample the motor encoders at a fixed rate, and stop a motor and push
+// an event if it stalls or the following error is too large
+void encoder_task(void)
 {
-#if defined(MANIP) || defined(CUTE)
-  if (AVR32_PM.RCAUSE.wdt) {
-      setPin(LED3_GPIO, 0); // turn on LED3
-  }
-#endif
-  wdt_disable();
+    static U64 last = 0;
+    char msg[64];
+    int i;
+
+    U64 now = time_us();
+    if (now - last < 1000000UL / kEncRate) return;
+    last = now;
+
+    for (i=0; i<NUM_MOTORS; ++i) {
+        if (sEnc[i].brd < 0) continue;
+        long pos = motor_pos(i);
+        int moving = motor_moving(i);
+        if (sEnc[i].tripped) {
+            // re-arm once the motor has stopped
+            if (!moving) encoder_ref(i);
+            continue;
+        }
+        U16 cnt = (U16)read_counter(sEnc[i].brd);
+        short diff = (short)(cnt - sEnc[i].last);     // (handles counter wrap-around)
+        sEnc[i].last = cnt;
+        sEnc[i].count += diff;
+        // following error is the difference between measured and commanded steps
+        long err = (long)(sEnc[i].count * sEnc[i].scale) - (pos - sEnc[i].ref);
+        long absErr = err < 0 ? -err : err;
+        sEnc[i].err = err;
+        if (absErr > sEnc[i].maxErr) sEnc[i].maxErr = absErr;
+        // keep track of how far we moved without seeing an encoder count
+        if (diff || !moving) sEnc[i].stallPos = pos;
+        long moved = pos - sEnc[i].stallPos;
+        if (moved < 0) moved = -moved;
+        float stall = kEncStallCounts * (sEnc[i].scale < 0 ? -sEnc[i].scale : sEnc[i].scale);
+        if (moving && moved > stall) {
+            sprintf(msg, "m%d ENC STALL POS=%ld ERR=%ld", i, pos, err);
+            log_add(LOG_STOP, i, pos, "encoder stall");
+        } else if (absErr > sEnc[i].tol) {
+            sprintf(msg, "m%d ENC ERR=%ld POS=%ld", i, err, pos);
+            log_add(LOG_STOP, i, pos, "encoder error");
+        } else {
+            continue;
+        }
+        motor_stop(i);
+        sEnc[i].tripped = 1;
+        add_response(EVT_ID, 1, msg);
+    }
 }
+#endif
 
 //-----------------------------------------------------------------------------
-// initialize the PWM output
-// PWM channel initialization
-//
-#define PWM_CLK     187500   // PWM clock rate Hz (187500 = 12MHz / 64)
-#define PWM_CHAN    6        // use PWM6
-#define PWM_PIN     AVR32_PWM_6_2_PIN
-#define PWM_FN      AVR32_PWM_6_2_FUNCTION
-#define PWM_WID     2        // pulse width (clock ticks, must be less than kMinTop)
+// capture samples of GPIO port A and/or B into cap_buff at a fixed rate
+// Inputs: port='a','b' or 'x' (both), cy=CPU cycles per sample, num=number of samples,
+//         trig=trigger channel (or -1 for none), edge=1 to trigger on rising edge
+// Returns: error string, or NULL on success
+// Notes: USB commands are not serviced during the capture, and the motor
+//        interrupts are left running so they may add jitter to the sample times
+char *capture(char port, U32 cy, int num, int trig, int edge)
+{
+    volatile avr32_gpio_port_t *gpa = &AVR32_GPIO.port[0];
+    volatile avr32_gpio_port_t *gpb = &AVR32_GPIO.port[1];
+    U16 *pt = cap_buff;
+    U32 t, v;
+    int i;
 
-static pwm_opt_t pwm_opt = {
-    // PWM controller configuration.
-    .diva = AVR32_PWM_DIVA_CLK_OFF,
-    .divb = AVR32_PWM_DIVB_CLK_OFF,
-    .prea = AVR32_PWM_PREA_MCK,
-    .preb = AVR32_PWM_PREB_MCK
-};
-static avr32_pwm_channel_t pwm_channel = {
-//    .CMR.calg = PWM_MODE_LEFT_ALIGNED,       // Channel mode.
-//    .CMR.cpol = PWM_POLARITY_LOW,            // Channel polarity.
-//    .CMR.cpd = PWM_UPDATE_PERIOD,            // Not used the first time.
-//    .CMR.cpre = AVR32_PWM_CPRE_MCK_DIV_64,   // Channel prescaler.
-    .cdty = PWM_WID,// Channel duty cycle, should be < CPRD (2 --> 10 microsec)
-    .cprd = 20,     // Channel period (set later)
-    .cupd = 0,      // Channel update is not used here
-    .ccnt = 0
-    // With these settings, the output waveform rate will be : (12000000/64)/20
-};
+    cap_num = cap_pos = 0;
+    cap_port = 0;
+    if (wdt_flag) wdt_clear();
 
-// run PWM at specified rate (0 = stop)
-void pwm_spd(float rate)
-{
-	// (i can't figure out how to initialize these in the variable definition)
-    pwm_channel.CMR.calg = PWM_MODE_LEFT_ALIGNED;       // Channel mode.
-    pwm_channel.CMR.cpol = PWM_POLARITY_HIGH;           // Channel polarity.
-    pwm_channel.CMR.cpd  = PWM_UPDATE_PERIOD;           // Not used the first time.
-    pwm_channel.CMR.cpre = AVR32_PWM_CPRE_MCK_DIV_64;   // Channel prescaler.
+    if (trig >= 0) {
+        // wait for the trigger pin to be in the pre-trigger state, then for the edge
+        volatile avr32_gpio_port_t *gpt = &AVR32_GPIO.port[trig >> 5];
+        U32 mask = 1UL << (trig & 0x1f);
+        U32 want = edge ? mask : 0;
+        U32 timeout = (U32)(kCapMaxTime * FCPU);
+        t = Get_sys_count();
+        while ((gpt->pvr & mask) == want) {
+            if ((U32)(Get_sys_count() - t) > timeout) return "no trigger";
+        }
+        while ((gpt->pvr & mask) != want) {
+            if ((U32)(Get_sys_count() - t) > timeout) return "no trigger";
+        }
+        if (wdt_flag) wdt_clear();
+    }
 
-    if (rate) {
-        // initialize the PWM if necessary
-        if (!pwm_flag) {
-            pwm_init(&pwm_opt);
-            pwm_flag = 1;   // (stopped)
+    // sample at exact multiples of the sample period
+    // (separate loops for each port to keep the sampling as tight as possible)
+    t = Get_sys_count();
+    switch (port) {
+      case 'a':
+        for (i=0; i<num; ++i) {
+            while ((S32)(Get_sys_count() - t) < 0) ;
+            v = gpa->pvr;
+            *(pt++) = (U16)v;
+            *(pt++) = (U16)(v >> 16);
+            t += cy;
         }
-        // calculate PWM period
-        unsigned long rcl = (unsigned long)(PWM_CLK / rate);
-        if (rcl > 0xfffff) rcl = 0xfffff;   // cprd is 20 bits
-        if (rcl < kMinTop) rcl = kMinTop;
-        pwm_channel.cprd = rcl;
-        if (pwm_flag == 1) { // stopped?
-            // init this channel and start the PWM
-            pwm_channel_init(PWM_CHAN, &pwm_channel);
-            // enable PWM function pin if necessary
-            if (output_mode[PWM_PIN] != 3) {
-                output_mode[PWM_PIN] = 3;
-                gpio_enable_module_pin(PWM_PIN, PWM_FN);
-            }
-            pwm_start_channels(1 << PWM_CHAN);  // start pwm
-            pwm_flag = 2; // (running)
-        } else {
-            // already running, so just update the period
-            AVR32_PWM.channel[PWM_CHAN].cupd = rcl; // (will update period on the next cycle)
+        break;
+      case 'b':
+        for (i=0; i<num; ++i) {
+            while ((S32)(Get_sys_count() - t) < 0) ;
+            *(pt++) = (U16)gpb->pvr;
+            t += cy;
         }
-    } else if (pwm_flag == 2) {
-        // drive the output pin low
-        gpio_clr_gpio_pin(PWM_PIN); // (set the pin low first to try to avoid a transient pulse)
-        gpio_enable_gpio_pin(PWM_PIN);
-        gpio_clr_gpio_pin(PWM_PIN); // (must clear pin again, since enable_gpio_pin apparently resets this)
-        output_mode[PWM_PIN] = 1;
-        // stop the PWM
-        pwm_stop_channels(1 << PWM_CHAN);
-        pwm_flag = 1; // (stopped)
+        break;
+      default:
+        for (i=0; i<num; ++i) {
+            while ((S32)(Get_sys_count() - t) < 0) ;
+            v = gpa->pvr;
+            *(pt++) = (U16)gpb->pvr;
+            *(pt++) = (U16)v;
+            *(pt++) = (U16)(v >> 16);
+            t += cy;
+        }
+        break;
     }
+    cap_port = port;
+    cap_num = num;
+    cap_cy = cy;
+    return NULL;
 }
 
 //-----------------------------------------------------------------------------
-// activate the watchdog timer
-void wdt_scheduler(void)
+// initialize the event log, keeping records from before the reset if possible
+void log_init(void)
 {
-  // If Reset Cause is due to a Watchdog reset just relaunch Watchdog and turn
-  // on LED3 on to let user know that a new wdt reset has occured (MANIP/CUTE only).
-  if (AVR32_PM.RCAUSE.wdt) {
-      wdt_reenable();
-      wdt_flag = 2;
-  // If Reset Cause is due to a Power On or external reset...
-//  } else if (AVR32_PM.RCAUSE.por || AVR32_PM.RCAUSE.ext) {
-  } else {
-      // Save current value in GPLP register (preserved across reset)
-    //  pm_write_gplp(&AVR32_PM,0,current_wdt_value);
-      // enable the watchdog timer
-      wdt_enable(current_wdt_value);
-      wdt_flag = 1;
-  }
+    if (AVR32_PM.RCAUSE.por || evt_log.magic != kLogMagic ||
+        evt_log.head - evt_log.tail > kLogSize)
+    {
+        memset(&evt_log, 0, sizeof(evt_log));
+        evt_log.magic = kLogMagic;
+    }
+    log_add(LOG_RESET, 0, AVR32_PM.rcause, NULL);
 }
 
-// read comma-separated channels from string
-// returns error string, or NULL on success
-char *getValues(int *chan, char *str, int num, int max)
+//-----------------------------------------------------------------------------
+// add a record to the event log (may be called from an interrupt)
+// Inputs: type=event type, arg,val=event argument and value, str=static string or NULL
+void log_add(int type, int arg, long val, const char *str)
 {
-    int i,j,n;
-    for (i=0,j=0,n=0; ; ++j) {
-        char ch = str[j];
-        if (ch == ',' || !ch) {
-            if (n >= max) return "value out of range";
-            if (i >= num) return "too many channels";
-            chan[i++] = n;
-            n = 0;
-            if (!ch) break;
-        } else if (ch >= '0' && ch <= '9') {
-            n = 10 * n + ch - '0';
-        } else {
-            return "invalid channel";
-        }
+    U64 t = time_us();
+    int en = Is_global_interrupt_enabled();
+    Disable_global_interrupt();
+    int i = evt_log.head & (kLogSize - 1);
+    evt_log.rec[i].time = t;
+    evt_log.rec[i].str = str;
+    evt_log.rec[i].val = val;
+    evt_log.rec[i].type = type;
+    evt_log.rec[i].arg = arg;
+    // overwrite the oldest record if the log is full
+    if (++evt_log.head - evt_log.tail > kLogSize) {
+        ++evt_log.tail;
+        ++evt_log.lost;
     }
-    return NULL;
+    if (en) Enable_global_interrupt();
 }
 
-// delay loop
-// (apparently there is are delay_ms() and delay_us() functions defined
-//  in delay.h that I could use instead of just looping here)
-#if defined(MANIP) || defined(CUTE)
-int delay(int del_num)
+//-----------------------------------------------------------------------------
+// remove the oldest record from the event log
+// Inputs: rec=record to fill in
+// Returns: sequence number of the record, or -1 if the log is empty
+long log_next(LogRec *rec)
 {
-    int i, n;
-    int dummy=0;
-    if (del_num < kNumDelay) {
-        n = cfg_del[del_num];
-        for (i=0; i<n; ++i) ++dummy;
+    long seq = -1;
+    // (the record may be overwritten by an interrupt while we copy it)
+    Disable_global_interrupt();
+    if (evt_log.tail != evt_log.head) {
+        seq = (long)evt_log.tail;
+        *rec = evt_log.rec[evt_log.tail & (kLogSize - 1)];
+        ++evt_log.tail;
     }
-    return dummy;
+    Enable_global_interrupt();
+    return seq;
+}
+
+//-----------------------------------------------------------------------------
+// print an event log record
+// Inputs: buf=output buffer, seq=record sequence number, rec=record
+// Returns: number of characters printed
+int log_print(char *buf, long seq, LogRec *rec)
+{
+    int n = sprintf(buf, "%ld %s", seq, log_type_str[(int)rec->type]);
+    switch (rec->type) {
+      case LOG_RESET:
+        n += sprintf(buf+n, " CAUSE=0x%lx", rec->val);
+        break;
+      case LOG_BAD:
+      case LOG_FULL:
+        n += sprintf(buf+n, " ID=%c", rec->arg ? rec->arg : '-');
+        if (rec->type == LOG_FULL) n += sprintf(buf+n, " LEN=%ld", rec->val);
+        break;
+      default:
+        n += sprintf(buf+n, " m%d POS=%ld", rec->arg, rec->val);
+        break;
+    }
+    if (rec->str) n += sprintf(buf+n, " ERR=%s", rec->str);
+    return n + sprint_time(buf+n, rec->time);
 }
-#endif
 
 //-----------------------------------------------------------------------------
 // this is the task that handles incoming commands over USB, executes them, and sends a response
@@ -940,7 +2633,6 @@ void resurfacer_task()
     int len, pos, i, j, n, n2;
     char msg_buff[512];
     char cmd_buff[bsiz];
-    static char out_buff[OUT_SIZE];
     static char buf[EP_SIZE_TEMP2];
 
     if (!Is_device_enumerated()) return;            // Check if USB HID is enumerated
@@ -997,6 +2689,9 @@ void resurfacer_task()
  			
  			    // Command: m# CMD - motor commands
  				int mot_num = cmd[1] - '0';
+ 				// any command for this motor refreshes its heartbeat
+ 				hb_last[mot_num] = time_ms;
+ 				hb_tripped[mot_num] = 0;
  				cmd = dat;
  				dat = strtok(NULL, " ");
  				// motor commands
@@ -1009,6 +2704,7 @@ void resurfacer_task()
                     int lat, count;
 				    unsigned rc;
 #endif
+				    U64 t = time_us();  // (time of position reading)
 				    switch (mot_num) {
 				      case 0:
                         spd   = (m0_running && m0_motorOn) ? (int)m0_curSpeed : 0;
@@ -1017,8 +2713,8 @@ void resurfacer_task()
 				        src   = m0_src;
 #ifdef DEBUG
 				        rc    = m0_curRC;
-				        lat   = m0_latency;
-				        count = m0_lastCount;
+				        lat   = m0_latMax;
+				        count = m0_drops;
 #endif
                         break;
 				      case 1:
@@ -1028,8 +2724,8 @@ void resurfacer_task()
 				        src   = m1_src;
 #ifdef DEBUG
 				        rc    = m1_curRC;
-				        lat   = m1_latency;
-				        count = m1_lastCount;
+				        lat   = m1_latMax;
+				        count = m1_drops;
 #endif
                         break;
 				      case 2:
@@ -1039,27 +2735,30 @@ void resurfacer_task()
 				        src   = m2_src;
 #ifdef DEBUG
 				        rc    = m2_curRC;
-				        lat   = m2_latency;
-				        count = m2_lastCount;
+				        lat   = m2_latMax;
+				        count = m2_drops;
 #endif
                         break;
                     }
 #ifdef DEBUG
-                    sprintf(msg_buff, "m%d SPD=%c%d POS=%ld CLK=%d RC=%u LAT=%d CNT=%d",
+                    n = sprintf(msg_buff, "m%d SPD=%c%d POS=%ld CLK=%d RC=%u LAT=%d CNT=%d",
 						mot_num, dir, spd, pos, src, rc, lat, count);
 #else
                     if (m0_stepMode && mot_num == 0) {
-                       sprintf(msg_buff, "m%d SPD=%c%d POS=%ld MOD=%d NXT=%ld",
+                       n = sprintf(msg_buff, "m%d SPD=%c%d POS=%ld MOD=%d NXT=%ld",
                             mot_num, dir, spd, pos, (int)m0_stepMode, m0_stepNext);
                     } else {
-                       sprintf(msg_buff, "m%d SPD=%c%d POS=%ld CLK=%d",
+                       n = sprintf(msg_buff, "m%d SPD=%c%d POS=%ld CLK=%d",
 						    mot_num, dir, spd, pos, src);
 			        }
 #endif
+                    sprint_time(msg_buff + n, t);
 					ok = 1;
 				} else if (!strcmp(cmd,"stop") || !strcmp(cmd,"ramp") || !strcmp(cmd,"step")) {
 					int speed, step=0;
 					long dest;
+					home_abort(mot_num);
+					servo_off(mot_num);
 				    if (!strcmp(cmd,"stop")) {
 					    speed = 0;
 					} else if (!strcmp(cmd,"step")) {
@@ -1185,6 +2884,8 @@ void resurfacer_task()
                     }
                 } else if (!strcmp(cmd,"spd")) {        // run motor at specified speed
 					float speed;
+					home_abort(mot_num);
+					servo_off(mot_num);
 					if (!dat) { err = "no speed"; break; }
                     if (!sscanf(dat, "%f", &speed)) {
                         err = "invalid speed";
@@ -1336,6 +3037,8 @@ void resurfacer_task()
                         ok = 1;
                     }
                 } else if (!strcmp(cmd,"halt")) {       // halt motor immediately
+                    home_abort(mot_num);
+                    servo_off(mot_num);
                     switch (mot_num) {
                       case 0:
                         m0_rampTo = (unsigned int)(m0_actClock / m0_minSpeed);
@@ -1401,6 +3104,8 @@ void resurfacer_task()
                         }
                         if (dat[0] == '0' || dat[0] == '1') {
                             int val = dat[0] - '0';
+                            // the servo can't track position while the motor is off
+                            if (!val) servo_off(mot_num);
                             setPin(n, val ^ sMotor[mot_num].onInv);
                             *onPt = val;
                         } else if (dat[0] == '+' || dat[0] == '-') {
@@ -1433,17 +3138,7 @@ void resurfacer_task()
 						sprintf(msg_buff,"m%d POS=%ld",mot_num,pos);
 						ok = 1;
 					} else if (sscanf(dat, "%ld", &pos) > 0) {
-                        switch (mot_num) {
-                          case 0:
-                            m0_motorPos = pos;
-                            break;
-                          case 1:
-                            m1_motorPos = pos;
-                            break;
-                          case 2:
-                            m2_motorPos = pos;
-                            break;
-                        }
+                        motor_setPos(mot_num, pos);
                         sprintf(msg_buff,"m%d POS=%ld",mot_num,pos);
                         ok = 1;
                     }
@@ -1466,23 +3161,205 @@ void resurfacer_task()
 					} else if (sscanf(dat, "%u", &acc) > 0) {
 					    if (acc < kMotorAccMin) acc = kMotorAccMin;
 					    if (acc > kMotorAccMax) acc = kMotorAccMax;
-                        switch (mot_num) {
-                          case 0:
-                            m0_acc = acc;
-                            m0_rampScl = (float)(kClockFreq / kPrescale) / acc;
-                            break;
-                          case 1:
-                            m1_acc = acc;
-                            m1_rampScl = (float)(kClockFreq / kPrescale) / acc;
-                            break;
-                          case 2:
-                            m2_acc = acc;
-                            m2_rampScl = (float)(kClockFreq / kPrescale) / acc;
-                            break;
-                        }
+					    motor_setAcc(mot_num, acc);
                         sprintf(msg_buff,"m%d ACC=%u",mot_num,acc);
                         ok = 1;
                     }
+				} else if (!strcmp(cmd,"trig")) {   // get/set position triggers
+				    if (dat && !strcmp(dat,"clr")) {
+				        long pos = 0;
+				        dat = strtok(NULL," ");
+				        if (dat && sscanf(dat, "%ld", &pos) <= 0) { err = "invalid position"; break; }
+				        trig_clear(mot_num, !dat, pos);
+				    } else if (dat) {
+				        long pos;
+				        if (sscanf(dat, "%ld", &pos) <= 0) { err = "invalid position"; break; }
+				        dat = strtok(NULL," ");
+				        if (!dat) { err = "no action"; break; }
+				        err = trig_add(mot_num, pos, dat);
+				        if (err) break;
+				    }
+				    // list the triggers
+				    j = sprintf(msg_buff, "m%d TRIG=", mot_num);
+				    if (!trig_num[mot_num]) j += sprintf(msg_buff+j, "none");
+				    for (i=0; i<trig_num[mot_num]; ++i) {
+				        int chan = trig[mot_num][i].chan;
+				        j += sprintf(msg_buff+j, "%s%ld:", i ? "," : "", trig[mot_num][i].pos);
+				        switch (trig[mot_num][i].action) {
+				          case TRIG_CLR:
+				          case TRIG_SET:
+				            j += sprintf(msg_buff+j, "p%c%d=%d", chan < 32 ? 'a' : 'b', chan & 0x1f,
+				                         trig[mot_num][i].action == TRIG_SET);
+				            break;
+				          case TRIG_ADC:
+				            j += sprintf(msg_buff+j, "adc%d", chan);
+				            break;
+				          default:
+				            j += sprintf(msg_buff+j, "log");
+				            break;
+				        }
+				    }
+				    if (trig_lost) sprintf(msg_buff+j, " LOST=%d", trig_lost);
+				    ok = 1;
+				} else if (!strcmp(cmd,"hb")) {     // get/set motion heartbeat timeout
+				    if (dat) {
+				        int ms = atoi(dat);
+				        if (ms < 0 || ms > kMaxHeartbeat || (!ms && strcmp(dat,"0"))) {
+				            err = "invalid timeout";
+				            break;
+				        }
+				        hb_ms[mot_num] = ms;
+				    }
+				    sprintf(msg_buff, "m%d HB=%u", mot_num, hb_ms[mot_num]);
+				    ok = 1;
+				} else if (!strcmp(cmd,"goto")) {   // move to position using the position servo
+				    long pos;
+				    unsigned spd, max = kClockFreq / (kPrescale * kMinTop);
+				    int on;
+				    switch (mot_num) {
+				      case 0:
+				        spd = m0_servoMax;
+				        break;
+				      case 1:
+				        spd = m1_servoMax;
+				        break;
+				      default:
+				        spd = m2_servoMax;
+				        break;
+				    }
+				    if (dat) {
+				        if (home[mot_num].state) { err = "motor is homing"; break; }
+				        if (sscanf(dat, "%ld", &pos) <= 0) { err = "invalid position"; break; }
+				        dat = strtok(NULL," ");
+				        if (dat) {
+				            spd = atoi(dat);
+				            if (spd < kMinSpeed || spd > max) { err = "invalid speed"; break; }
+				        }
+				        err = servo_goto(mot_num, pos, spd);
+				        if (err) break;
+				    }
+				    switch (mot_num) {
+				      case 0:
+				        on = m0_servo;
+				        pos = m0_servoTo;
+				        break;
+				      case 1:
+				        on = m1_servo;
+				        pos = m1_servoTo;
+				        break;
+				      default:
+				        on = m2_servo;
+				        pos = m2_servoTo;
+				        break;
+				    }
+				    if (on) {
+				        sprintf(msg_buff, "m%d GOTO=%ld SPD=%u", mot_num, pos, spd);
+				    } else {
+				        sprintf(msg_buff, "m%d GOTO=off SPD=%u", mot_num, spd);
+				    }
+				    ok = 1;
+				} else if (!strcmp(cmd,"home")) {   // home motor to a limit switch
+				    if (dat) {
+				        int dir, fast, slow;
+				        long backoff, ofs = 0;
+				        if (!strcmp(dat,"0")) {
+				            if (home[mot_num].state) {
+				                home_abort(mot_num);
+				                motor_halt(mot_num);
+				            }
+				        } else {
+				            if (!strcmp(dat,"+")) {
+				                dir = 0;
+				            } else if (!strcmp(dat,"-")) {
+				                dir = 1;
+				            } else {
+				                err = "invalid direction";
+				                break;
+				            }
+				            dat = strtok(NULL," ");
+				            if (!dat || (fast = atoi(dat)) < kMinSpeed) { err = "invalid fast speed"; break; }
+				            dat = strtok(NULL," ");
+				            if (!dat || (slow = atoi(dat)) < kMinSpeed || slow > fast) { err = "invalid slow speed"; break; }
+				            dat = strtok(NULL," ");
+				            if (!dat || sscanf(dat, "%ld", &backoff) <= 0 || backoff < 0) { err = "invalid backoff"; break; }
+				            dat = strtok(NULL," ");
+				            if (dat && sscanf(dat, "%ld", &ofs) <= 0) { err = "invalid offset"; break; }
+				            if (home[mot_num].state) { err = "already homing"; break; }
+				            err = home_start(mot_num, dir, fast, slow, backoff, ofs);
+				            if (err) break;
+				        }
+				    }
+				    sprintf(msg_buff, "m%d HOME=%s", mot_num, home_state_str[(int)home[mot_num].state]);
+				    ok = 1;
+				} else if (!strcmp(cmd,"perf")) {   // get/reset interrupt performance histograms
+				    unsigned *latHist, *durHist, *latMax, *durMax, *drops;
+				    int src;
+				    switch (mot_num) {
+				      case 0:
+				        latHist = m0_latHist;  durHist = m0_durHist;
+				        latMax = &m0_latMax;   durMax = &m0_durMax;
+				        drops = &m0_drops;     src = m0_src;
+				        break;
+				      case 1:
+				        latHist = m1_latHist;  durHist = m1_durHist;
+				        latMax = &m1_latMax;   durMax = &m1_durMax;
+				        drops = &m1_drops;     src = m1_src;
+				        break;
+				      default:
+				        latHist = m2_latHist;  durHist = m2_durHist;
+				        latMax = &m2_latMax;   durMax = &m2_durMax;
+				        drops = &m2_drops;     src = m2_src;
+				        break;
+				    }
+				    if (dat) {
+				        if (strcmp(dat,"0")) { err = "use 0 to reset"; break; }
+				        Disable_global_interrupt();
+				        memset(latHist, 0, sizeof(m0_latHist));
+				        memset(durHist, 0, sizeof(m0_durHist));
+				        *latMax = *durMax = *drops = 0;
+				        Enable_global_interrupt();
+				    }
+				    float lmax = *latMax * 1e6 / motor_actClock[src-1];
+				    float dmax = *durMax * 1e6 / FCPU;
+				    j = sprintf(msg_buff, "m%d LAT=", mot_num);
+				    for (i=0; i<kPerfBins; ++i) {
+				        j += sprintf(msg_buff+j, i ? ",%u" : "%u", latHist[i]);
+				    }
+				    j += sprintf(msg_buff+j, " DUR=");
+				    for (i=0; i<kPerfBins; ++i) {
+				        j += sprintf(msg_buff+j, i ? ",%u" : "%u", durHist[i]);
+				    }
+				    sprintf(msg_buff+j, " DROP=%u LMAX=%.1fus DMAX=%.1fus", *drops, lmax, dmax);
+				    ok = 1;
+#if defined(MANIP) || defined(CUTE)
+				} else if (!strcmp(cmd,"enc")) {    // get/set encoder monitor
+				    if (dat && !strcmp(dat,"off")) {
+				        sEnc[mot_num].brd = -1;
+				    } else if (dat) {
+				        int brd = atoi(dat);
+				        float scale;
+				        long tol;
+				        if (brd < 0 || brd > 3) { err = "invalid board"; break; }
+				        dat = strtok(NULL," ");
+				        if (!dat || !sscanf(dat, "%f", &scale) || !scale) { err = "invalid scale"; break; }
+				        dat = strtok(NULL," ");
+				        if (!dat || sscanf(dat, "%ld", &tol) <= 0 || tol <= 0) { err = "invalid tolerance"; break; }
+				        sEnc[mot_num].brd = brd;
+				        sEnc[mot_num].scale = scale;
+				        sEnc[mot_num].tol = tol;
+				        sEnc[mot_num].maxErr = 0;
+				        encoder_ref(mot_num);
+				    }
+				    if (sEnc[mot_num].brd < 0) {
+				        sprintf(msg_buff,"m%d ENC=off",mot_num);
+				    } else {
+				        sprintf(msg_buff,"m%d ENC=%d SCL=%.6g TOL=%ld ERR=%ld MAX=%ld%s",mot_num,
+				                sEnc[mot_num].brd, sEnc[mot_num].scale, sEnc[mot_num].tol,
+				                sEnc[mot_num].err, sEnc[mot_num].maxErr,
+				                sEnc[mot_num].tripped ? " (TRIPPED)" : "");
+				    }
+				    ok = 1;
+#endif
 				}
 			} else if (cmd[0]=='p' && (cmd[1]=='a' || cmd[1]=='b')) {
 
@@ -1581,41 +3458,22 @@ void resurfacer_task()
                     } else {
                         c = 'a';
                     }
+                    U64 t = time_us();
                     if (n2 == n) {
-                        sprintf(msg_buff,"p%c%d VAL=%s", c, n, val_str);
+                        j = sprintf(msg_buff,"p%c%d VAL=%s", c, n, val_str);
                     } else {
-                        sprintf(msg_buff,"p%c%d-%d VAL=%s", c, n, n2, val_str);
+                        j = sprintf(msg_buff,"p%c%d-%d VAL=%s", c, n, n2, val_str);
                     }
+                    sprint_time(msg_buff + j, t);
                 }
 
 #if defined(MANIP) || defined(CUTE)
             } else if (cmd[0]=='c' && cmd[1]>='0' && cmd[1]<='3' && !cmd[2]) {
 
                 // Command: c## - read Steve's encoder counter (SNO+)
-                int brd = cmd[1] - '0';
-                unsigned count = 0;
-                setPin(DEV0, 1);    // device 1
-                setPin(BRD0, brd & 0x01); // address the board
-                setPin(BRD1, brd & 0x02);
-                setPin(BRDSEL, 1);  // select the board
-                setPin(XRD, 0);     // read data
-                delay(0);           // wait for data to stabilize
-                // read high byte
-                for (i=0; i<kNumDatLines; ++i) {
-                    count |= (gpio_get_pin_value(cfg_dat[i]) << (8+i));
-                }
-                setPin(BYSEL, 1);   // select low byte
-                delay(1);           // wait for data to stabilize
-                // read low byte
-                for (i=0; i<kNumDatLines; ++i) {
-                    count |= (gpio_get_pin_value(cfg_dat[i]) << i);
-                }
-                // return outputs to their defaults
-                setPin(XRD, 1);     // completes the inihibit logic
-                setPin(BRDSEL, 0);
-                setPin(DEV0, 0);
-                setPin(BYSEL, 0);
-                sprintf(msg_buff,"%s VAL=%u (0x%.4x)",cmd,count,count);
+                unsigned count = read_counter(cmd[1] - '0');
+                n = sprintf(msg_buff,"%s VAL=%u (0x%.4x)",cmd,count,count);
+                sprint_time(msg_buff + n, time_us());
                 ok = 1;
 
             } else if (cmd[0]=='a' && cmd[1]>='0' && cmd[1]<='3' &&
@@ -1646,12 +3504,12 @@ void resurfacer_task()
                 setPin(XWR, 0);     // write the control register (initiates conversion)
                 setPin(XWR, 1);
                 // wait for conversion (INT goes low)
-                for (i=0; ; ++i) {
-                    if (gpio_get_pin_value(INT)) {
-                        if (i < kMaxWaitConv) continue;
+                U32 t0 = Get_sys_count();
+                while (gpio_get_pin_value(INT)) {
+                    if (Get_sys_count() - t0 > NS_TO_CY(kMaxWaitConv)) {
                         err = "conversion error";
+                        break;
                     }
-                    break;
                 }
                 setPin(XRD, 0);     // read data
                 delay(4);           // wait for data to stabilize
@@ -1676,7 +3534,8 @@ void resurfacer_task()
                     if (rng & 0x01) setPin(WDAT+3, 0);
                     if (rng & 0x02) setPin(WDAT+4, 0);
                 }
-                sprintf(msg_buff,"%s VAL=%u (0x%.4x)",cmd,count,count);
+                n = sprintf(msg_buff,"%s VAL=%u (0x%.4x)",cmd,count,count);
+                sprint_time(msg_buff + n, time_us());
                 ok = 1;
 
             } else if (cmd[0]=='d' && cmd[1]>='0' && cmd[1]<='3' &&
@@ -1785,8 +3644,9 @@ void resurfacer_task()
                             e = getValues(cfg_dat, dat+2, kNumDatLines, IO_CHANNELS);
                             if (e) err = e;
                         } else if (dat[0] == 'x') {
-                            e = getValues(cfg_del, dat+2, kNumDelay, 0x7fffffff);
+                            e = getValues(cfg_del, dat+2, kNumDelay, kMaxDelay+1);
                             if (e) err = e;
+                            set_delays();
                         } else {
                             err = "unknown argument";
                         }
@@ -1809,28 +3669,67 @@ void resurfacer_task()
             } else if (cmd[0]=='p' && cmd[1]>='0' && cmd[1]<='6' && !cmd[2]) {
 
                 int pwm_num = cmd[1] - '0';
-                if (pwm_num != 6) { err = "invalid pwm"; break; }   // only support PWM6 for now
+                int p = pwm_index(pwm_num);
+                if (p < 0) { err = "invalid pwm"; break; }
  				cmd = dat;
  				dat = strtok(NULL, " ");
                 if (!cmd || !strcmp(cmd,"stat")) {  // get PWM status
-                    float spd = pwm_flag == 2 ? ((float)PWM_CLK / pwm_channel.cprd) : 0;
-                    sprintf(msg_buff, "p%d SPD=%.6g", pwm_num, spd);
+                    float spd = pwm[p].run ? ((float)PWM_CLK / pwm[p].rc) : 0;
+                    n = sprintf(msg_buff, "p%d SPD=%.6g", pwm_num, spd);
+                    if (pwm[p].ramping) n += sprintf(msg_buff+n, " RAMP=%.6g", pwm[p].target);
+                    if (pwm[p].num) sprintf(msg_buff+n, " CNT=%ld/%ld", pwm[p].count, pwm[p].num);
+                    ok = 1;
+                } else if (!strcmp(cmd,"acc")) {    // get/set PWM ramp acceleration
+                    if (dat) {
+                        int acc = atoi(dat);
+                        if (acc < kPwmAccMin || acc > kPwmAccMax) { err = "acc out of range"; break; }
+                        pwm[p].acc = acc;
+                    }
+                    sprintf(msg_buff,"p%d ACC=%u", pwm_num, pwm[p].acc);
                     ok = 1;
  				} else {
- 				    if (!strcmp(cmd,"spd")) {
+                    long num = 0;
+ 				    if (!strcmp(cmd,"spd") || !strcmp(cmd,"ramp")) {
                         if (!dat) { err = "no speed"; break; }
-                        pwm_spd(atof(dat));
+                        float spd = atof(dat);
+                        if (spd < 0) { err = "invalid speed"; break; }
+                        dat = strtok(NULL, " ");
+                        if (dat) {
+                            num = atol(dat);
+                            if (num <= 0) { err = "invalid count"; break; }
+                        }
+                        if (cmd[0] == 's' || !spd) {
+                            pwm[p].ramping = 0;
+                            pwm_spd(p, spd);
+                        } else {
+                            pwm[p].target = spd;
+                            if (!pwm[p].run) pwm_spd(p, kPwmMinSpeed);
+                            pwm[p].ramping = 1;
+                        }
+                        if (pwm[p].run) pwm_count(p, num);
+                        ok = 1;
+                    } else if (!strcmp(cmd,"stop")) {   // ramp down to a stop
+                        if (pwm[p].run) {
+                            pwm[p].target = 0;
+                            pwm[p].ramping = 1;
+                        }
                         ok = 1;
-                    } else if (!strcmp(cmd,"halt") || !strcmp(cmd,"stop")) {
-                        pwm_spd(0);
+                    } else if (!strcmp(cmd,"halt")) {   // stop immediately
+                        pwm_halt(p);
                         ok = 1;
-                    }
-                    if (pwm_flag == 2) {
-                        float spd = (float)PWM_CLK / pwm_channel.cprd;
-                        sprintf(msg_buff,"p%d SPD=%.6g (rc=%lu)", pwm_num, spd, pwm_channel.cprd);
                     } else {
+                        err = "unknown command";
+                        break;
+                    }
+                    if (!pwm[p].run) {
                         sprintf(msg_buff,"p%d STOPPED", pwm_num);
+                    } else if (pwm[p].ramping) {
+                        sprintf(msg_buff,"p%d RAMP=%.6g%s", pwm_num, pwm[p].target, pwm[p].target ? "" : " (stopping)");
+                    } else {
+                        float spd = (float)PWM_CLK / pwm[p].rc;
+                        sprintf(msg_buff,"p%d SPD=%.6g (rc=%lu)", pwm_num, spd, pwm[p].rc);
                     }
+                    if (num) sprintf(msg_buff+strlen(msg_buff), " NUM=%ld", num);
                 }
 
             } else if (cmd[0]=='a' && cmd[1]=='d' && cmd[2]=='c' &&
@@ -1839,13 +3738,8 @@ void resurfacer_task()
                 // Command: adc# - read specified ADC
                 short n = cmd[3] - '0';
                 short chan = sADC[n].channel;
-                short pin = sADC[n].pin;
                 // enable ADC if not done already
-                if (output_mode[pin] != 3) {
-                    gpio_enable_module_pin(pin, sADC[i].function);
-                    adc_enable(&AVR32_ADC, chan);
-                    output_mode[pin] = 3;
-                }
+                adc_chan_enable(n);
                 // read and discard old value if necessary
                 if (adc_check_eoc(&AVR32_ADC, chan) == HIGH) {
                     adc_get_value(&AVR32_ADC, chan);
@@ -1853,12 +3747,130 @@ void resurfacer_task()
                 // start new conversion
                 adc_start(&AVR32_ADC);
                 signed val = adc_get_value(&AVR32_ADC, chan);
-                sprintf(msg_buff,"%s VAL=%d", cmd, val);
+                j = sprintf(msg_buff,"%s VAL=%d", cmd, val);
+                sprint_time(msg_buff + j, time_us());
                 ok = 1;
 			        
+            } else if (!strcmp(cmd,"watch")) {
+
+                // Command: watch [pa#[-#]|pb#[-#] [0|1]] - push events when inputs change
+                if (dat && !strcmp(dat,"0")) {
+                    watch_mask[0] = watch_mask[1] = 0;
+                } else if (dat) {
+                    err = getRange(dat, &n, &n2);
+                    if (err) break;
+                    char *pt = strtok(NULL," ");
+                    int on = (!pt || strcmp(pt,"0"));
+                    if (n > n2) { i = n; n = n2; n2 = i; }
+                    for (i=n; i<=n2; ++i) {
+                        U32 bit = 1UL << (i & 0x1f);
+                        if (on) {
+                            // start watching from the current pin state
+                            watch_last[i >> 5] = (watch_last[i >> 5] & ~bit) |
+                                                 (AVR32_GPIO.port[i >> 5].pvr & bit);
+                            watch_mask[i >> 5] |= bit;
+                        } else {
+                            watch_mask[i >> 5] &= ~bit;
+                        }
+                    }
+                }
+                sprintf(msg_buff, "watch pa=%.8lx pb=%.3lx LOST=%d", (unsigned long)watch_mask[0],
+                        (unsigned long)watch_mask[1], watch_lost);
+                ok = 1;
+
+            } else if (!strcmp(cmd,"cap")) {
+
+                // Command: cap [PORT RATE [NUM [TRIG]]] - logic capture of GPIO ports
+                //          cap rd [OFS] - read back captured samples
+                int words = (cap_port == 'a' ? 2 : (cap_port == 'b' ? 1 : 3));
+                int digits = (cap_port == 'a' ? 8 : (cap_port == 'b' ? 3 : 11));
+                if (!dat) {
+                    if (cap_num) {
+                        char *p = (cap_port == 'a' ? "pa" : (cap_port == 'b' ? "pb" : "pab"));
+                        sprintf(msg_buff, "cap %s NUM=%d RATE=%.6g OFS=%d", p, cap_num,
+                                (float)FCPU / cap_cy, cap_pos);
+                    } else {
+                        strcpy(msg_buff, "cap NUM=0");
+                    }
+                } else if (!strcmp(dat,"rd")) {
+                    char *pt = strtok(NULL," ");
+                    if (pt) {
+                        cap_pos = atoi(pt);
+                        if (cap_pos < 0 || cap_pos > cap_num) { err = "invalid offset"; break; }
+                    }
+                    // return as many samples as will fit (high bit first, PB above PA)
+                    n = sprintf(msg_buff, "cap OFS=%d NUM=", cap_pos);
+                    j = (cap_num - cap_pos) < kCapChunk / digits ? cap_num - cap_pos : kCapChunk / digits;
+                    n += sprintf(msg_buff + n, "%d DAT=", j);
+                    U16 *pt16 = cap_buff + cap_pos * words;
+                    for (i=0; i<j; ++i, pt16+=words) {
+                        switch (cap_port) {
+                          case 'a':
+                            n += sprintf(msg_buff + n, "%.4x%.4x", pt16[1], pt16[0]);
+                            break;
+                          case 'b':
+                            n += sprintf(msg_buff + n, "%.3x", pt16[0] & 0xfff);
+                            break;
+                          default:
+                            n += sprintf(msg_buff + n, "%.3x%.4x%.4x", pt16[0] & 0xfff, pt16[2], pt16[1]);
+                            break;
+                        }
+                    }
+                    cap_pos += j;
+                } else {
+                    char port;
+                    float rate;
+                    int num, trig = -1, edge = 0;
+                    if (!strcmp(dat,"pa")) {
+                        port = 'a';
+                        words = 2;
+                    } else if (!strcmp(dat,"pb")) {
+                        port = 'b';
+                        words = 1;
+                    } else if (!strcmp(dat,"pab")) {
+                        port = 'x';
+                        words = 3;
+                    } else {
+                        err = "port must be pa, pb or pab";
+                        break;
+                    }
+                    dat = strtok(NULL," ");
+                    if (!dat || !sscanf(dat, "%f", &rate) || rate <= 0) { err = "invalid rate"; break; }
+                    if (rate > (float)FCPU / kCapMinCy) { err = "rate too high"; break; }
+                    num = kCapSize / words;
+                    dat = strtok(NULL," ");
+                    if (dat) {
+                        num = atoi(dat);
+                        if (num < 1 || num > kCapSize / words) { err = "invalid number"; break; }
+                        dat = strtok(NULL," ");
+                    }
+                    if (num / rate > kCapMaxTime) { err = "capture too long"; break; }
+                    if (dat) {
+                        // trigger: pa#+, pa#-, pb#+ or pb#-
+                        n = strlen(dat);
+                        if (n < 4 || dat[0] != 'p' || (dat[1] != 'a' && dat[1] != 'b') ||
+                            (dat[n-1] != '+' && dat[n-1] != '-') || !isdigit(dat[2]))
+                        {
+                            err = "invalid trigger";
+                            break;
+                        }
+                        trig = atoi(dat + 2) + (dat[1] == 'b' ? 32 : 0);
+                        edge = (dat[n-1] == '+');
+                        if (trig >= IO_CHANNELS) { err = "channel out of range"; break; }
+                    }
+                    err = capture(port, (U32)((float)FCPU / rate + 0.5), num, trig, edge);
+                    if (err) break;
+                    sprintf(msg_buff, "cap NUM=%d RATE=%.6g", cap_num, (float)FCPU / cap_cy);
+                }
+                ok = 1;
+
 			} else if (!strcmp(cmd,"halt")) {
 
                 // Command: halt - stop all motors immediately
+                for (i=0; i<NUM_MOTORS; ++i) {
+                    home_abort(i);
+                    servo_off(i);
+                }
                 m0_rampTo = (unsigned int)(m0_actClock / m0_minSpeed);
                 m0_rampFlag = 3;
                 m1_rampTo = (unsigned int)(m1_actClock / m1_minSpeed);
@@ -1880,14 +3892,80 @@ void resurfacer_task()
                 // Command: help - show command help
                 strcpy(msg_buff, "Available commands:\n"
 #ifdef MANIP
-                                 "pa#; pb#; adc#; a##; c#; d#[#]; s#[#]; cfg\n"
+                                 "pa#; pb#; adc#; cap; watch; a##; c#; d#[#]; s#[#]; cfg\n"
 #else
-                                 "pa#; pb#; adc#\n"
+                                 "pa#; pb#; adc#; cap; watch\n"
 #endif
-                                 "m# [ramp,spd,stop,halt,stat,pos,on,dir,acc]\n"
-                                 "p# [spd,stop,halt,stat]; nop; ver; ser; help");
+                                 "m# [ramp,spd,stop,halt,stat,pos,on,dir,acc,enc,perf,trig,home,goto,hb]\n"
+#if defined(MANIP) || defined(CUTE)
+                                 "p6 [spd,ramp,stop,halt,stat,acc]; "
+#else
+                                 "p# [spd,ramp,stop,halt,stat,acc]; "
+#endif
+                                 "save; time; log; load; nop; ver; ser; help");
             	ok = 1;
 
+            } else if (!strcmp(cmd,"save")) {
+
+                // Command: save [0] - save configuration to flash (or erase it)
+                int save = (!dat || strcmp(dat,"0"));
+                config_save(save);
+                strcpy(msg_buff, save ? "SAVED" : "ERASED");
+                ok = 1;
+
+            } else if (!strcmp(cmd,"time")) {
+
+                // Command: time - get timebase time (for synchronizing with host clock)
+                strcpy(msg_buff, "time");
+                sprint_time(msg_buff + 4, time_us());
+                ok = 1;
+
+            } else if (!strcmp(cmd,"log")) {
+
+                // Command: log [SEQ] - drain event log (starting from record SEQ if specified)
+                LogRec rec;
+                long seq;
+                U32 lost;
+                if (dat) {
+                    unsigned long from;
+                    if (sscanf(dat, "%lu", &from) <= 0) { err = "invalid sequence number"; break; }
+                    Disable_global_interrupt();
+                    // (limit to the records that are still in the log)
+                    if ((long)(evt_log.head - from) > kLogSize) from = evt_log.head - kLogSize;
+                    if ((long)(evt_log.head - from) < 0) from = evt_log.head;
+                    evt_log.tail = from;
+                    Enable_global_interrupt();
+                }
+                Disable_global_interrupt();
+                lost = evt_log.lost;
+                evt_log.lost = 0;
+                Enable_global_interrupt();
+                j = sprintf(msg_buff, "log LOST=%lu", (unsigned long)lost);
+                // return as many records as fit in the response
+                while (j < 400 && (seq = log_next(&rec)) >= 0) {
+                    j += sprintf(msg_buff+j, "; ");
+                    j += log_print(msg_buff+j, seq, &rec);
+                }
+                if (evt_log.tail != evt_log.head) strcpy(msg_buff+j, "; MORE");
+                ok = 1;
+
+            } else if (!strcmp(cmd,"load")) {
+
+                // Command: load - get CPU load and worst main loop time since last "load"
+                U64 now = time_us();
+                U64 us = now - load_start;
+                U64 idle = load_idle;
+                U32 maxLoop = load_maxLoop;
+                load_start = now;
+                load_idle = 0;
+                load_maxLoop = 0;
+                float load = 0;
+                if (us) load = 100.0 * (1.0 - (float)idle / us);
+                if (load < 0) load = 0;
+                sprintf(msg_buff, "LOAD=%.1f%% MAX=%luus TIME=%lums", load,
+                        (unsigned long)(maxLoop / (FCPU / 1000000L)), (unsigned long)(us / 1000));
+                ok = 1;
+
             } else if (!strcmp(cmd,"wdt")) {
 
                 // Command: wdt - get/set watchdog timer
@@ -1919,6 +3997,10 @@ void resurfacer_task()
 #else
                 sprintf(msg_buff, "Version %.2f (DEAP)", VERSION);
 #endif
+                // indicate if motor state was restored after a reset
+                if (state_restored) {
+                    strcat(msg_buff, state_restored == 1 ? " RESTORED" : " RESTORED (was moving)");
+                }
  				ok = 1;
  			} else if (!strcmp(cmd,"nop")) {
  			    // Command: nop - do nothing
@@ -1930,29 +4012,10 @@ void resurfacer_task()
  		     ok = 0;
  		     if (!err) err = "unknown cmd";
  		     strcpy(msg_buff, err);
+ 		     log_add(LOG_BAD, idx, 0, err);
  		  }
  		  // add this response to the returned message
- 		  n = strlen(msg_buff);
- 		  // (save room for "X.BAD " header and "\0" terminator)
- 		  if (data_length + n + 7 < OUT_SIZE) {
-             // prefix response with command index if provided
-             if (idx) {
-                out_buff[data_length++] = idx;
-                out_buff[data_length++] = '.';
-             }
-             if (ok) {
-                strcpy(out_buff + data_length, "OK");  data_length += 2;
-             } else {
-			    strcpy(out_buff + data_length, "BAD"); data_length += 3;
-             }
-             if (n) {
-                out_buff[data_length++] = ' ';
-                memcpy(out_buff + data_length, msg_buff, n);  data_length += n;
-             }
-             out_buff[data_length++] = '\n';
-             out_buff[data_length] = '\0';  // null-terminate response
-             has_data = 1;
- 		  }
+ 		  add_response(idx, ok, msg_buff);
  		  if (pos >= len) break;
  	   }
     }
@@ -2042,9 +4105,19 @@ int main(void)
     //pm_enable_clk32_no_wait(&AVR32_PM, AVR32_PM_OSCCTRL32_STARTUP_0_RCOSC);
 
 	// Configure Osc0 in crystal mode (i.e. use of an external crystal source, with
-	// frequency FOSC0) with an appropriate startup time then switch the main clock
-	// source to Osc0.
-    pcl_switch_to_osc(PCL_OSC0, FOSC0, OSC0_STARTUP);
+	// frequency FOSC0) with an appropriate startup time, then run PLL0 from Osc0 and
+	// switch the main clock to FCPU (this also sets the flash wait state)
+    static pcl_freq_param_t pcl_freq_param = {
+        .cpu_f        = FCPU,
+        .pba_f        = FPBA,
+        .osc0_f       = FOSC0,
+        .osc0_startup = OSC0_STARTUP
+    };
+    pcl_configure_clocks(&pcl_freq_param);
+
+    // load saved configuration, then restore the motor state if we were reset
+    config_load();
+    state_restored = state_restore();
 
     // initialize digital outputs used for motor control
     gpio_local_init();
@@ -2067,7 +4140,7 @@ int main(void)
     setPin(BRD1, 0);
     setPin(BRDSEL, 0);
     setPin(ENCP, 1);
-    setPin(PWM_PIN, 0);
+    setPin(sPWM[0].pin, 0);
     for (i=0; i<8; ++i) {
         // set write bit to zero
         setPin(WDAT+i, 0); 
@@ -2087,6 +4160,18 @@ int main(void)
 	    output_mode[sMotor[i].pin] = 3;
     	// Initialize the timer/counter.
 	    tc_init_waveform(tc, &waveform_opt[i]);  // Initialize the timer/counter waveform.
+    }
+    // register the PWM interrupt handler (used for the timebase and counting pulses)
+    INTC_register_interrupt(&pwm_irq, AVR32_PWM_IRQ, AVR32_INTC_INT0);
+    // register the limit switch interrupt for each GPIO port group used by homing
+    for (i=0; i<NUM_MOTORS; ++i) {
+        if (sLimit[i].hi >= 0) INTC_register_interrupt(&home_irq, AVR32_GPIO_IRQ_0 + sLimit[i].hi/8, AVR32_INTC_INT1);
+        if (sLimit[i].lo >= 0) INTC_register_interrupt(&home_irq, AVR32_GPIO_IRQ_0 + sLimit[i].lo/8, AVR32_INTC_INT1);
+    }
+    time_init();
+    log_init();     // (after time_init so the reset record is timestamped)
+    for (i=0; i<NUM_PWMS; ++i) {
+        pwm[i].acc = kPwmAccDefault;
     }
 	Enable_global_interrupt();
 
@@ -2099,23 +4184,70 @@ int main(void)
     }
 
     // configure ADC - lower the ADC clock to match the ADC characteristics
-    // (because we configured the CPU clock to 12MHz and the ADC clock characteristics
-    // are usually lower)
-    AVR32_ADC.mr |= 0x1 << AVR32_ADC_MR_PRESCAL_OFFSET;
+    // (ADC clock = FPBA / ((PRESCAL + 1) * 2), which must not exceed ADC_CLK_MAX)
+    AVR32_ADC.mr |= ADC_PRESCAL << AVR32_ADC_MR_PRESCAL_OFFSET;
     adc_configure(&AVR32_ADC);
     
     Enable_global_exception();
     // THIS IS BAD BECAUSE WE ARE USING USART PINS FOR OTHER PURPOSES
-    //init_dbg_rs232(FOSC0);
+    //init_dbg_rs232(FPBA);
     pcl_configure_usb_clock();
     usb_task_init();
     resurfacer_task_init();
 
     wdt_init();
+#if defined(MANIP) || defined(CUTE)
+    set_delays();
+#endif
+
+    load_start = time_us();
 
+    // Main loop: Each pass runs the tasks, then sleeps until the next
+    // interrupt (USB start of frame every 1 ms, motor TC, etc) if there
+    // is nothing that needs continuous attention.  Idle cycles are
+    // accounted for the "load" command, so everything else (including
+    // all interrupts except the short one that wakes us) counts as load.
     while (TRUE) {
+        U32 t0 = Get_sys_count();
+        Disable_global_interrupt();
+        U32 flags = sched_flags;
+        sched_flags = 0;
+        Enable_global_interrupt();
+
         usb_task();
         resurfacer_task();
+        if (watch_mask[0] | watch_mask[1]) watch_task();
+        if (trig_head != trig_tail) trig_task();
+        if (flags & EVT_SOF) pwm_task();
+        // (these keep running on the PWM5 timebase if USB frames stop)
+        if (time_ms != task_ms) {
+            task_ms = time_ms;
+            home_task();
+            hb_task();
+            state_task();
+        }
+#if defined(MANIP) || defined(CUTE)
+        if (flags & EVT_SOF) encoder_task();
+#endif
+        U32 dt = Get_sys_count() - t0;
+        if (dt > load_maxLoop) load_maxLoop = dt;
+
+        // don't sleep if USB isn't up yet or we have a response to send
+        if (!Is_device_enumerated() || has_data) continue;
+        // watched inputs are polled continuously instead of sleeping, so
+        // count passes with no scheduled events as idle time
+        if (watch_mask[0] | watch_mask[1]) {
+            if (!flags) load_idle += dt / (FCPU / 1000000L);
+            continue;
+        }
+        // (an interrupt setting sched_flags after this test only delays
+        //  the tasks until the next SOF interrupt)
+        if (sched_flags) continue;
+        // (time the sleep with the PWM5 timebase, since the CPU cycle
+        //  counter stops while we are asleep)
+        U64 sleep_us = time_us();
+        SLEEP(AVR32_PM_SMODE_IDLE);
+        load_idle += time_us() - sleep_us;
     }
 }
 
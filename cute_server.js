@@ -14,19 +14,68 @@
 //
 // Revisions:   2017-03-16 - v0.01 P. Harvey created
 //              2017-04-28 - v0.9 PH - Implemented control algorithm
+//              2026-10-18 - v0.10 PH - Synchronize AVR timebase to wall clock and
+//                                      timestamp motor positions
+//              2026-10-18 - v0.11 PH - Set motor heartbeat so motors stop if we die
+//              2026-10-18 - v0.12 PH - Poll hardware in a pipeline that waits for the
+//                                      Adam and AVR0 responses before driving motors
+//              2026-10-18 - v0.13 PH - Frame Adam Modbus/TCP responses and match them to
+//                                      requests by transaction ID
+//              2026-10-18 - v0.14 PH - Added --adam option (eg. to use adam_sim.js)
+//              2026-10-18 - v0.15 PH - Added --sim option to use simulated AVR boards
+//                                      (avr_sim.js) instead of USB devices
+//              2026-10-18 - v0.16 PH - Keep a day of history in a typed-array ring buffer
+//              2026-10-18 - v0.17 PH - Added min/max/mean history tiers of up to a month
+//              2026-10-18 - v0.18 PH - Archive all polled readings in binary files (cute_archive.js)
+//              2026-10-18 - v0.19 PH - Added "hist" command for decimated history queries
+//              2026-10-18 - v0.20 PH - Send connection state and history to new clients
+//                                      in a single cached binary snapshot
+//              2026-10-18 - v0.21 PH - Send live readings as binary messages, and skip
+//                                      them for clients that can't keep up
 //
-// Syntax:      node cute_server.js
+// Syntax:      node cute_server.js [--adam HOST[:PORT]] [--sim NUM [--sim-latency MS]]
+//
+//              --adam  - connect to the ADAM-6017 at the specified address
+//                        instead of the default (eg. "localhost:5020" for the
+//                        adam_sim.js simulator)
+//              --sim   - use NUM simulated AVR boards instead of USB devices
+//                        (the first two take the AVR0 and AVR1 serial numbers)
+//              --sim-latency - response latency of simulated AVRs (ms, default 2)
 //
 // Notes:       Requires additional node libraries to run.  Install them
 //              by typing: "npm install usb"
 //
-const kServerVersion    = 'v0.9';
+const kServerVersion    = 'v0.21';
 
 const kAtmel            = 0x03eb;   // Atmel USB manufacturer ID
 const kEVK1101          = 0x2300;   // EVK-1101 USB device ID
-const kPosHisLen        = 600;      // position history length
-const kHardwarePollTime = 80;       // hardware polling time (ms)
+const kPosHisLen        = 600;      // position history length sent to clients (s)
+const kHisLen           = 86400;    // length of history ring buffer (s)
+const kHisChan          = 7;        // history channels: 3 x damper position, 3 x add weight, air pressure
+
+// downsampled history tiers (min/max/mean of all polled readings in each bucket)
+const kHisTiers = [
+    // [ bucket length (s), number of buckets ]
+    [ 1, 3600 ],            // 1 hour at 1 s
+    [ 10, 8640 ],           // 1 day at 10 s
+    [ 60, 10080 ],          // 1 week at 1 min
+    [ 600, 4464 ]           // 31 days at 10 min
+];
+const kMaxHisPoints     = 10000;    // maximum number of points returned by a history query
+const kHisChunk         = 500;      // maximum number of points in each history response
+const kSnapshotType     = 0x53;     // type byte of binary connection snapshot ("S")
+const kLiveType         = 0x46;     // type byte of binary live readings ("F")
+const kMaxClientBacklog = 65536;    // hold live readings for clients with more than this queued (bytes)
+const kMinPollTime      = 40;       // minimum hardware polling cycle time (ms)
+const kPollTimeout      = 250;      // maximum time to wait for hardware poll responses (ms)
+const kReportTime       = 160;      // time between reports of polling results to clients (ms)
+const kPollAdam         = 0x01;     // pollWait bit for Adam response
+const kPollAVR0         = 0x02;     // pollWait bit for AVR0 response
+const kPollTags         = '0123456789'; // AVR0 limit switch response IDs (cycled to match responses to polls)
+const kAdamRetryTime    = 1000;     // minimum time between Adam connection attempts (ms)
 const kMaxBadPolls      = 3;        // number of bad polls before deactivating
+const kTimeSyncPolls    = 125;      // number of polls between AVR time synchronizations (5-30 s)
+const kMotorHeartbeat   = 1000;     // AVR stops a moving motor if not polled for this long (ms)
 
 const kNumLimit         = 6;        // number of limit switches to poll: "PA0-<kNumLimit-1>"
 const kTopLimit         = 0;        // PA0 is a top limit (and PA2, PA4, ...)
@@ -58,6 +107,21 @@ const kBellowArea       = kPi * (kBellowDia * kBellowDia) / 4;
 const kBellowPos        = 8.55;     // distance of bellow from centre (cm)
 const kDamperPos        = 36.3;     // damper radius position (cm)
 
+const kAdamUnit         = 1;        // Adam Modbus unit ID
+const kAdamTimeout      = 1000;     // time to wait for a response to an Adam request (ms)
+const kAdamMaxPending   = 4;        // maximum number of outstanding Adam requests
+
+// Modbus exception codes
+const kModbusException = {
+    1: 'illegal function',
+    2: 'illegal data address',
+    3: 'illegal data value',
+    4: 'server device failure',
+    6: 'server device busy',
+    10: 'gateway path unavailable',
+    11: 'gateway target failed to respond'
+};
+
 // states for ADAM-6017 (adamState)
 const kAdamBad          = -1;       // communication error
 const kAdamNotConnected = 0;        // Adam is not connected
@@ -107,23 +171,34 @@ var helpMessage =
         '<td class=nr>/log MSG</td><td>- enter log message</td></tr>' +
     '<tr><td class=nr>/avr# CMD</td><td>- send AVR command</td>' +
         '<td class=nr>/name [WHO]</td><td>- get/set client name</td></tr>' +
-    '<tr><td class=nr>/cal</td><td>- show Adam calibration</td>' +
+    '<tr><td class=nr>/cal</td><td>- show Adam calibration and timing</td>' +
         '<td class=nr>/verbose [on|off]</td><td>- get/set verbose state</td></tr>' +
     "<tr><td class=nr>/list</td><td>- list connected AVR's</td>" +
         '<td class=nr>/who</td><td>- list connected clients</td></tr>' +
+    '<tr><td class=nr>/hist ID CHANS T0 T1 NUM</td><td colspan=3>- get history (eg. "/hist 1 0,1,2 -3600 0 600")</td></tr>' +
     '</table>';
 
 var adam;               // client for communicating with ADAM-6017
 var adamRaw = [];       // raw Adam ADC values (x8)
 var adamCal = [0,0,0,0,0,0,kAirPressureNom]; // calibrated Adam values
 var adamState = kAdamNotConnected;
-
-var usb = require('usb');
+var adamBuff = null;    // received Adam data that isn't a complete frame yet
+var adamTid = 0;        // transaction ID of last Modbus request
+var adamPending = {};   // outstanding Adam requests, keyed by transaction ID
+var adamNumPending = 0; // number of outstanding Adam requests
+var adamPollTid = -1;   // transaction ID of the current hardware poll read
+var adamPollOK = 0;     // flag set when the current hardware poll read succeeded
+var adamStats;          // Adam request statistics (see AdamResetStats())
+
+var usb;                // USB library (not loaded if AVRs are simulated)
 var fs = require('fs');
 var WebSocketServer = require('websocket').server;
 var http = require('http');
+var Archive = require('./cute_archive.js');
 
 var avrs = [];          // AVR devices
+var simAVRs = 0;        // number of simulated AVRs (0 to use USB devices)
+var simLatency;         // response latency of simulated AVRs (ms)
 var avrOK = [];         // flag set if AVR is responding OK
 var foundAVRs = 0;      // number of recognized AVRs
 var conn = [];          // web client connections
@@ -141,11 +216,25 @@ var motorDir = [0,0,0];     // current motor directions
 var limitSwitch = [0,0,0,0,0,0]; // limit-switches: top,bottom for each stage (1=open)
 var lastSpd = '0 0 0';      // last motor speeds sent to clients (as string)
 var motorPos = [0,0,0];     // motor positions
-var history = [];           // history of measured values
+var motorTime = [0,0,0];    // wall-clock times of motor positions (ms, 0 if unknown)
+var adamTime = 0;           // wall-clock time of the last Adam readings (ms, mid-request)
+var timeSyncPolls = 0;      // polls since last AVR time synchronization
+var hisTime = new Float64Array(kHisLen);   // time of each history slot (s, index is time % kHisLen)
+var hisVals = new Float32Array(kHisLen * kHisChan); // history values (kHisChan per slot, NaN if no reading)
 var historyTime = -1;       // time of most recent history entry
+var hisTiers = kHisTiers.map(function(x) { return NewHisTier(x[0], x[1]) });
+var hisNow = new Float32Array(kHisChan);    // current values for the history tiers
+var snapshot = null;        // cached binary snapshot for new clients (see GetSnapshot())
+var snapshotKey = '';       // state that the cached snapshot was built from
 var logCalTime = -1;        // time we last logged calculated values
-
-var intrvl;                 // interval timer for polling hardware
+var archive = new Archive.Archive('cute_'); // binary archive of all polled readings
+
+var pollTimer;              // timer for next hardware poll, or for poll timeout
+var pollWait = 0;           // bit mask for poll responses we are waiting for (kPollAdam, kPollAVR0)
+var pollStart = 0;          // time that the current hardware poll started (ms)
+var pollSeq = 0;            // sequence number of the current hardware poll
+var adamConnectTime = 0;    // time of the last Adam connection attempt (ms)
+var reportTime = 0;         // time we last reported polling results to clients (ms)
 var fullPoll = 0;           // flag set to report polling results back to clients
 var verbose = 0;            // flag to log all raw ADC measurements
 
@@ -157,6 +246,8 @@ var damperAddWeight = [0, 0, 0];    // weights to add to the 3 dampers (kg)
 //-----------------------------------------------------------------------------
 // Main script
 
+ParseArgs(process.argv.slice(2));
+
 // create HTTP server (don't implement request listener here
 // because that will be done by our WebSocketServer)
 var server = http.createServer(function(request, response) { });
@@ -171,80 +262,78 @@ wsServer.on('request', HandleClientRequest);
 
 process.on('SIGINT', HandleSigInt); // handle CTRL-C (SIGINT signal)
 
-usb.on('attach', OpenAVR);      // handle new USB devices being connected
-usb.on('detach', ForgetAVR);    // handle USB devices being disconnected
-usb.on('error', HandleError);   // handle USB errors
+if (!simAVRs) {
+    usb = require('usb');
+    usb.on('attach', OpenAVR);      // handle new USB devices being connected
+    usb.on('detach', ForgetAVR);    // handle USB devices being disconnected
+    usb.on('error', HandleError);   // handle USB errors
+}
 
 Log();              // (blank log line)
 Log(kBanner);       // print startup banner
 
+AdamResetStats();
 ConnectToAdam();    // connect to ADAM-6017 ADC via TCP
-FindAVRs();         // find all connected AVR USB devices
+if (simAVRs) {
+    OpenSimAVRs();  // create our simulated AVRs
+} else {
+    FindAVRs();     // find all connected AVR USB devices
+}
 
-// set interval timer to poll the hardware
-intrvl = setInterval(PollHardware, kHardwarePollTime);
+// start polling the hardware
+PollHardware();
 
 //-----------------------------------------------------------------------------
 // poll the hardware
 function PollHardware()
 {
-    var bad;
-
-    fullPoll = !fullPoll;
-
-    if (adamState != kAdamOK) {
-        // send empty ADC readings if Adam didn't respond
-        if (fullPoll) {
-            var t = AddToHistory(0);
-            PushData('F ' + (t % kPosHisLen));
-        }
-        if (!adam) ConnectToAdam();
-        bad = 'Adam';
-    } else if (!avrOK[0]) {
-        bad = 'AVR0';
-    }
+    pollStart = Date.now();
+    pollWait = 0;
+    ++pollSeq;
 
-    if (bad) {
-        if (badPolls < kMaxBadPolls) ++badPolls;
-        if (active && badPolls >= kMaxBadPolls) {
-            Log(bad, "poll error!  Position control deactivated");
-            Deactivate();
-        }
-    } else {
-        badPolls = 0;
-    }
+    // report results to clients at a fixed rate, regardless of the poll rate
+    fullPoll = (pollStart - reportTime >= kReportTime);
+    if (fullPoll) reportTime = pollStart;
 
     // poll ADAM-6017
-    if (adamState == kAdamWaiting || adamState == kAdamOK) {
-        // send command to read all 8 ADC's
-        // 0x01, 0x00 = transaction ID = 0
-        // 0x00, 0x00 = protocol ID = 0
-        // 0x00, 0x06 = message length = 6 bytes to follow
-        // 0x01       = unit ID = 1
-        // 0x04       = function code = 4 (read input registers)
-        // 0x00, 0x00 = address of first register = 0 (+ 0x4000)
-        // 0x00, 0x08 = number of registers to read = 8 (16 bytes)
-        if (!adam.write('010000000006010400000008', 'hex')) {
-            Log("Adam write error");
-        }
-        if (adamState == kAdamOK) {
-            adamState = kAdamWaiting;
-        } else if (adamState == kAdamWaiting) {
-            adamState = kAdamMissed;
-            Log("Adam not responding");
+    adamPollOK = 0;
+    if (adam && adamState >= kAdamMissed) {
+        AdamExpire();
+        // read all 8 ADC's
+        adamPollTid = AdamRead(0, 8);
+        if (adamPollTid >= 0) {
+            if (adamState == kAdamOK) adamState = kAdamWaiting;
+            pollWait |= kPollAdam;
         }
     } else if (adamState == kAdamNotConnected) {
         Log("Adam not connected!");
         adamState = kAdamBad;
+    } else if (!adam && pollStart - adamConnectTime >= kAdamRetryTime) {
+        ConnectToAdam();
+    }
+
+    var timeSync = 0;
+    if (++timeSyncPolls >= kTimeSyncPolls) {
+        timeSyncPolls = 0;
+        timeSync = 1;
     }
 
     for (var i=0; i<avrs.length; ++i) {
         if (avrs[i] == null) continue;
         avrOK[i] = 0;
+        // synchronize the AVR timebase periodically, and until we have a first sync
+        // (send before the poll so the round trip isn't delayed by the other commands)
+        if (i < 2 && (timeSync || avrs[i].timeOfs == null)) {
+            avrs[i].timeSent = Date.now();
+            avrs[i].SendCmd("h.time\n");
+        }
         var cmd;
         switch (i) {
             case 0: // AVR0
-                cmd = "f.m0;m1;m2;g.pa0-" + (kNumLimit-1) + "\n";   // poll limit switches
+                // (the limit switch response comes last, so it completes the AVR0
+                //  poll, and its ID identifies the poll so a late one is ignored)
+                cmd = "f.m0;m1;m2;" + PollTag(pollSeq) + ".pa0-" + (kNumLimit-1) + "\n";
+                pollWait |= kPollAVR0;
                 break;
             case 1: // AVR1
                 cmd = "c.nop\n";    // (nothing to do yet)
@@ -259,6 +348,123 @@ function PollHardware()
         }
         avrs[i].SendCmd(cmd);
     }
+
+    // wait for the responses (or time out)
+    pollTimer = setTimeout(PollDone, kPollTimeout);
+}
+
+//-----------------------------------------------------------------------------
+// Get the AVR0 limit switch response ID for a hardware poll
+// Inputs: seq=poll sequence number
+function PollTag(seq)
+{
+    return kPollTags[seq % kPollTags.length];
+}
+
+//-----------------------------------------------------------------------------
+// Handle a hardware poll response
+// Inputs: bit=pollWait bit for this response
+function PollResponse(bit)
+{
+    if (!(pollWait & bit)) return;  // (late response from a previous poll)
+    pollWait &= ~bit;
+    if (!pollWait) PollDone();
+}
+
+//-----------------------------------------------------------------------------
+// Finish a hardware poll after all responses arrived or we timed out,
+// then calculate and drive motors from this consistent set of readings
+function PollDone()
+{
+    var bad;
+
+    clearTimeout(pollTimer);
+
+    var gotAdam = adamPollOK;
+    var gotAVR0 = avrOK[0] && !(pollWait & kPollAVR0);
+    if (pollWait & kPollAdam) {
+        if (adamState == kAdamWaiting) {
+            adamState = kAdamMissed;
+            Log("Adam not responding");
+        }
+    }
+    if (!gotAdam) {
+        bad = 'Adam';
+    } else if (!gotAVR0) {
+        bad = 'AVR0';
+    }
+    pollWait = 0;
+
+    if (bad) {
+        if (badPolls < kMaxBadPolls) ++badPolls;
+        if (active && badPolls >= kMaxBadPolls) {
+            Log(bad, "poll error!  Position control deactivated");
+            Deactivate();
+        }
+    } else {
+        badPolls = 0;
+    }
+
+    if (gotAdam) {
+        Calculate();            // calculate damper positions, loads, etc
+        AddToHisTiers();        // (every poll contributes to the tier statistics)
+        // drive motors if active control is on (only with fresh motor positions)
+        if (active && !bad) Drive();
+    }
+
+    // archive the readings from this poll
+    var flags = (gotAdam ? Archive.kFlagAdam : 0) | (gotAVR0 ? Archive.kFlagAVR0 : 0) |
+                (active ? Archive.kFlagActive : 0);
+    if (flags & (Archive.kFlagAdam | Archive.kFlagAVR0)) {
+        archive.Add(Date.now(), flags, limitSwitch, adamRaw, adamCal, damperPosition,
+                    damperAddWeight, motorPos, motorSpd);
+    }
+
+    if (fullPoll) {
+        // save in history and send data back to web clients
+        // (send empty ADC readings if Adam didn't respond)
+        var t = AddToHistory(gotAdam);
+        PushLive(EncodeLive(t, gotAdam));
+        if (gotAdam) FlashLEDs(t);  // flashy lights
+    }
+
+    // start the next poll right away, but no faster than the minimum poll time
+    var wait = kMinPollTime - (Date.now() - pollStart);
+    pollTimer = setTimeout(PollHardware, wait > 0 ? wait : 0);
+}
+
+//-----------------------------------------------------------------------------
+// Parse command-line arguments
+function ParseArgs(args)
+{
+    for (var i=0; i<args.length; ++i) {
+        switch (args[i]) {
+            case '--adam': {
+                var a = (args[++i] || '').split(':');
+                if (a[0]) adamIP = a[0];
+                if (a[1]) adamPort = Number(a[1]);
+            }   break;
+            case '--sim':
+                simAVRs = Number(args[++i]) || 0;
+                break;
+            case '--sim-latency':
+                simLatency = Number(args[++i]);
+                break;
+            default:
+                console.log('Unknown option:', args[i]);
+                process.exit(1);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Convert an AVR timebase time (seconds, from a "T=" field) to wall-clock ms
+// (returns 0 if the AVR time hasn't been synchronized yet)
+function AvrTime(avrNum, t)
+{
+    var avr = avrs[avrNum];
+    if (!avr || avr.timeOfs == null) return 0;
+    return Number(t) * 1000 + avr.timeOfs;
 }
 
 //-----------------------------------------------------------------------------
@@ -294,13 +500,23 @@ function Calculate()
     }
 }
 
+//-----------------------------------------------------------------------------
+// Get motor position at the specified wall-clock time
+// (extrapolated from the timestamped motor status at the current speed)
+function MotorPosAt(i, t)
+{
+    if (!motorTime[i] || !t) return motorPos[i];
+    return motorPos[i] + motorSpd[i] * (t - motorTime[i]) / 1000;
+}
+
 //-----------------------------------------------------------------------------
 // Drive motors for active position control
 function Drive()
 {
     for (var i=0; i<3; ++i) {
         // check that motor position agrees with measured stage position
-        if (Math.abs(motorPos[i] / kMotorStepsPer_mm - stagePosition[i]) > kMotorTol) {
+        // (at the time the stage position was sampled)
+        if (Math.abs(MotorPosAt(i, adamTime) / kMotorStepsPer_mm - stagePosition[i]) > kMotorTol) {
             Log("Motor " + i + " error!  Position control deactivated");
             Deactivate();
             return;
@@ -387,6 +603,15 @@ function HandleClientRequest(request)
             Log('['+this.cuteName+'] '+Array.from(arguments).join(' '));
         };
         connection.HandleServerCommand = HandleServerCommand;
+        connection.SendHistory = SendHistory;
+        connection.SendLive = SendLive;
+        connection.liveData = null;     // live readings waiting to be sent
+        connection.liveSkipped = 0;     // number of live readings skipped for this client
+
+        // send any held live readings when the client catches up
+        if (connection.socket) {
+            connection.socket.on('drain', function() { connection.SendLive() });
+        }
 
         // handle all messages from users here
         connection.on('message', function(message) { this.HandleServerCommand(message) });
@@ -408,17 +633,9 @@ function HandleClientRequest(request)
 
         connection.Log('Connected');    // log this connection
 
-        // send message indicating whether or not we are active
-        connection.SendData('D ' + active);
-        // send current motor state
-        connection.SendData('E ' + lastSpd);
-
-        // send measurement history (packet "B")
-        for (var i=history.length-1; i>=0; --i) {
-            if (history[i].length < 3) continue;    // (don't send empty entries)
-            connection.SendData('B ' + ((historyTime - i) % kPosHisLen) +
-                                ' ' + history[i].join(' '));
-        }
+        // send active state, motor speeds and measurement history
+        // (a Buffer is sent as a binary message)
+        connection.SendData(GetSnapshot());
     }
     catch (err) {
         Log('Error handling client request');
@@ -458,6 +675,10 @@ function HandleServerCommand(message)
                 this.SendData(helpMessage);
                 break;
 
+            case 'hist':
+                this.SendHistory(str);
+                break;
+
             case 'active':
                 this.Activate(str);
                 break;
@@ -468,6 +689,12 @@ function HandleServerCommand(message)
                 } else {
                     LogReadings(1);
                 }
+                if (adamStats.num) {
+                    this.Respond('Adam round trip (ms): last', adamStats.last,
+                        'min', adamStats.min, 'mean', (adamStats.sum / adamStats.num).toFixed(1),
+                        'max', adamStats.max, '(' + adamStats.num, 'requests,',
+                        adamStats.lost, 'lost,', adamStats.stray, 'late,', adamStats.exc, 'exceptions)');
+                }
                 break;
 
             case 'list': {
@@ -595,6 +822,62 @@ function PushData(str)
     }
 }
 
+//-----------------------------------------------------------------------------
+// Push live readings to all web clients
+// Inputs: buff=binary live readings (the same Buffer is sent to every client)
+function PushLive(buff)
+{
+    for (var i=0; i<conn.length; ++i) {
+        conn[i].SendLive(buff);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Send live readings to a client, or hold them if the client is backlogged
+// Inputs: this=client connection, buff=binary live readings (or undefined to
+//         send held readings)
+// Notes: Only the most recent readings are held, so a slow client skips
+//        readings instead of accumulating them in the socket buffer
+function SendLive(buff)
+{
+    if (buff) this.liveData = buff;
+    if (!this.liveData) return;
+    if (this.socket && this.socket.writableLength > kMaxClientBacklog) {
+        if (!this.liveSkipped++) LogToFile('[' + this.cuteName + ']', 'Client backlogged');
+        return;
+    }
+    if (this.liveSkipped) {
+        LogToFile('[' + this.cuteName + ']', 'Client caught up (skipped', this.liveSkipped, 'readings)');
+        this.liveSkipped = 0;
+    }
+    this.SendData(this.liveData);
+    this.liveData = null;
+}
+
+//-----------------------------------------------------------------------------
+// Encode live readings for our web clients
+// Inputs: t=integer time of readings, valid=flag set if Adam readings are valid
+// Returns: Buffer with the following little-endian layout:
+//           0  Uint8        kLiveType
+//           1  Uint8        valid flag
+//           2  Uint16       history time slot (t % kPosHisLen)
+//           4  Float32 x 3  damper positions (mm)
+//          16  Float32 x 3  weights to add to dampers (kg)
+//          28  Float32      air pressure (hPa)
+function EncodeLive(t, valid)
+{
+    var buff = Buffer.alloc(32);
+    buff[0] = kLiveType;
+    buff[1] = valid ? 1 : 0;
+    buff.writeUInt16LE(t % kPosHisLen, 2);
+    for (var i=0; i<3; ++i) {
+        buff.writeFloatLE(valid ? damperPosition[i] : NaN, 4 + i * 4);
+        buff.writeFloatLE(valid ? damperAddWeight[i] : NaN, 16 + i * 4);
+    }
+    buff.writeFloatLE(valid ? adamCal[6] : NaN, 28);
+    return buff;
+}
+
 //=============================================================================
 // ADAM-6017 communication
 
@@ -603,6 +886,7 @@ function PushData(str)
 function ConnectToAdam()
 {
     var net = require('net');
+    adamConnectTime = Date.now();
     adam = new net.Socket();
 
     // handle connect message
@@ -612,28 +896,23 @@ function ConnectToAdam()
     });
     
     // handle incoming data from the ADAM-6017
+    // (TCP may split or combine responses, so reassemble them into
+    //  Modbus/TCP frames using the length from the MBAP header)
     adam.on('data', function(data) {
-        if (data.length != 25) return;
-        if (adamState == kAdamMissed) Log("Adam OK");
-        adamState = kAdamOK;
-        // read the returned values
-        for (var i=0, j=9; i<8; ++i, j+=2) {
-            adamRaw[i] = data[j] * 256 + data[j+1];
+        adamBuff = adamBuff ? Buffer.concat([adamBuff, data]) : data;
+        while (adamBuff && adamBuff.length >= 8) {
+            var len = adamBuff.readUInt16BE(4);     // (unit ID + PDU length)
+            if (adamBuff.readUInt16BE(2) != 0 || len < 2 || len > 254) {
+                Log("Adam framing error");
+                adamBuff = null;    // (discard everything and resynchronize)
+                break;
+            }
+            if (adamBuff.length < len + 6) break;   // wait for the rest of the frame
+            var frame = adamBuff.slice(0, len + 6);
+            adamBuff = adamBuff.slice(len + 6);
+            AdamFrame(frame);
         }
-        
-        Calculate();            // calculate damper positions, loads, etc
-        if (active) Drive();    // drive motors if active control is on
-
-        if (!fullPoll) return;
-
-        // save in history and send data back to web clients
-        var t = AddToHistory(0, damperPosition);
-        PushData('F ' + (t % kPosHisLen) + ' ' +
-                 damperPosition.map( function(x) { return x.toFixed(4) } ).join(' ') + ' ' +
-                 damperAddWeight.map( function(x) { return x.toFixed(4) } ).join(' ') + ' ' +
-                 adamCal[6].toFixed(3));
-
-        FlashLEDs(t);   // flashy lights
+        if (adamBuff && !adamBuff.length) adamBuff = null;
     });
 
     // handle connection close
@@ -655,6 +934,94 @@ function CloseAdam()
         adam = null;
     }
     adamState = kAdamBad;
+    adamBuff = null;
+    adamPending = {};
+    adamNumPending = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Send a Modbus request to read Adam input registers
+// Inputs: addr=first register address, num=number of registers
+// Returns: transaction ID, or -1 if too many requests are outstanding
+function AdamRead(addr, num)
+{
+    if (adamNumPending >= kAdamMaxPending) return -1;
+    adamTid = (adamTid + 1) & 0xffff;
+    var msg = Buffer.alloc(12);
+    msg.writeUInt16BE(adamTid, 0);  // transaction ID
+    msg.writeUInt16BE(0, 2);        // protocol ID = 0
+    msg.writeUInt16BE(6, 4);        // message length = 6 bytes to follow
+    msg[6] = kAdamUnit;             // unit ID
+    msg[7] = 4;                     // function code = 4 (read input registers)
+    msg.writeUInt16BE(addr, 8);     // address of first register (+ 0x4000)
+    msg.writeUInt16BE(num, 10);     // number of registers to read
+    adam.write(msg);
+    adamPending[adamTid] = { time: Date.now(), func: 4, num: num };
+    ++adamNumPending;
+    return adamTid;
+}
+
+//-----------------------------------------------------------------------------
+// Abandon Adam requests that have been outstanding for too long
+function AdamExpire()
+{
+    var now = Date.now();
+    for (var tid in adamPending) {
+        if (now - adamPending[tid].time < kAdamTimeout) continue;
+        delete adamPending[tid];
+        --adamNumPending;
+        ++adamStats.lost;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Reset Adam request statistics
+function AdamResetStats()
+{
+    adamStats = { num: 0, sum: 0, min: 0, max: 0, last: 0, lost: 0, stray: 0, exc: 0 };
+}
+
+//-----------------------------------------------------------------------------
+// Handle a complete Modbus/TCP frame from the Adam
+function AdamFrame(frame)
+{
+    var tid = frame.readUInt16BE(0);
+    var req = adamPending[tid];
+    if (!req) {
+        ++adamStats.stray;  // (response to an abandoned request)
+        return;
+    }
+    delete adamPending[tid];
+    --adamNumPending;
+
+    // update round-trip time statistics
+    var rtt = Date.now() - req.time;
+    adamStats.last = rtt;
+    if (!adamStats.num || rtt < adamStats.min) adamStats.min = rtt;
+    if (rtt > adamStats.max) adamStats.max = rtt;
+    adamStats.sum += rtt;
+    ++adamStats.num;
+
+    var func = frame[7];
+    if (func & 0x80) {
+        var code = frame[8];
+        ++adamStats.exc;
+        Log('Adam exception', code, '(' + (kModbusException[code] || 'unknown') + ')');
+    } else if (func != req.func || frame[8] != req.num * 2 || frame.length < 9 + req.num * 2) {
+        Log('Adam bad response');
+    } else {
+        if (tid != adamPollTid) return; // (late response to an earlier poll)
+        if (adamState == kAdamMissed) Log("Adam OK");
+        adamState = kAdamOK;
+        // read the returned values
+        for (var i=0, j=9; i<req.num; ++i, j+=2) {
+            adamRaw[i] = frame.readUInt16BE(j);
+        }
+        adamTime = req.time + rtt / 2;
+        adamPollOK = 1;
+    }
+    // (an exception or bad response fails the poll without waiting for the timeout)
+    if (tid == adamPollTid) PollResponse(kPollAdam);
 }
 
 //=============================================================================
@@ -683,37 +1050,83 @@ function OpenAVR(device)
     try {
         device.open();
         device.interfaces[0].claim();
-        // find first unused input >= 2
-        for (var i=2; ; ++i) {
-            if (i < avrs.length && avrs[i]) continue;
-            avrs[i] = device;
-            device.avrNum = i;
-            var endIn  = device.interfaces[0].endpoints[0];
-            var endOut = device.interfaces[0].endpoints[1];
-            endIn.avrNum  = i;
-            endOut.avrNum = i;
-            endIn.transferType  = usb.LIBUSB_TRANSFER_TYPE_BULK;
-            endOut.transferType = usb.LIBUSB_TRANSFER_TYPE_BULK;
-            endIn.timeout  = 1000;
-            endOut.timeout = 1000;
-            // (must install handlers before we start polling)
-            endIn.on('data', HandleData);
-            endIn.on('error', HandleError);
-            endOut.on('error', HandleError);
-            endIn.startPoll(4, 256);
-
-            // add member function to send command to AVR
-            device.SendCmd = SendCmd;
-            // send initial command to get AVR serial number and software version
-            device.SendCmd("a.ser;b.ver\n");
-            break;
-        }
+        var endIn  = device.interfaces[0].endpoints[0];
+        var endOut = device.interfaces[0].endpoints[1];
+        endIn.transferType  = usb.LIBUSB_TRANSFER_TYPE_BULK;
+        endOut.transferType = usb.LIBUSB_TRANSFER_TYPE_BULK;
+        endIn.timeout  = 1000;
+        endOut.timeout = 1000;
+        // (must install handlers before we start polling)
+        endIn.on('data', HandleData);
+        endIn.on('error', HandleError);
+        endOut.on('error', HandleError);
+        endIn.startPoll(4, 256);
+
+        // add member functions to access the AVR
+        device.SendCmd   = SendCmd;
+        device.SetAvrNum = SetAvrNum;
+        device.Release   = ReleaseAVR;
+        device.Close     = CloseAVR;
+        AddAVR(device);
     }
     catch (err) {
         Log('Error opening AVR device');
     }
 }
 
+//-----------------------------------------------------------------------------
+// Create our simulated AVRs
+// (the SimAVR object provides the same member functions as our USB devices)
+function OpenSimAVRs()
+{
+    var SimAVR = require('./avr_sim.js').SimAVR;
+    for (var i=0; i<simAVRs; ++i) {
+        var sn = i < avrSN.length ? avrSN[i] : 'ffffffff53494d' + i;
+        AddAVR(new SimAVR(sn, { latency: simLatency }, HandleData));
+    }
+    Log('Simulating', simAVRs, 'AVR' + (simAVRs == 1 ? '' : 's'));
+}
+
+//-----------------------------------------------------------------------------
+// Add a newly opened AVR to our list
+// (it will be renumbered once we get its serial number)
+function AddAVR(avr)
+{
+    // find first unused input >= 2
+    for (var i=2; i<avrs.length && avrs[i]; ++i) { }
+    avrs[i] = avr;
+    avr.SetAvrNum(i);
+    // send initial command to get AVR serial number and software version
+    avr.SendCmd("a.ser;b.ver\n");
+}
+
+//-----------------------------------------------------------------------------
+// Set the AVR number of our USB device
+function SetAvrNum(n)
+{
+    this.avrNum = n;
+    this.interfaces[0].endpoints[0].avrNum = n;
+    this.interfaces[0].endpoints[1].avrNum = n;
+}
+
+//-----------------------------------------------------------------------------
+// Stop communicating with an AVR USB device and close it
+function ReleaseAVR()
+{
+    var endIn = this.interfaces[0].endpoints[0];
+    endIn.device = this;
+    endIn.on('end', HandleEnd);
+    endIn.stopPoll();
+}
+
+//-----------------------------------------------------------------------------
+// Release the interface of our AVR USB device and close it
+function CloseAVR()
+{
+    this.interfaces[0].release(true, function(error) { });
+    this.close();
+}
+
 //-----------------------------------------------------------------------------
 // Send command to our AVR
 // Note: Command must be prefixed by a response ID (eg. "c." to ignore response)
@@ -830,9 +1243,7 @@ function HandleResponse(avrNum, responseID, msg)
                         }
                         // change the number of this AVR
                         avrs[i] = avrs[avrNum];
-                        avrs[i].avrNum = i;
-                        avrs[i].interfaces[0].endpoints[0].avrNum = i;
-                        avrs[i].interfaces[0].endpoints[1].avrNum = i;
+                        avrs[i].SetAvrNum(i);
                         avrs[avrNum] = null;
                         avrOK[i] = 1;
                         avrOK[avrNum] = 0;
@@ -852,6 +1263,9 @@ function HandleResponse(avrNum, responseID, msg)
                     avrs[avrNum].SendCmd('c.m0 on +;m1 on +;m2 on +\n');
                     // turn on motors
                     avrs[avrNum].SendCmd('c.m0 on 1;m1 on 1;m2 on 1\n');
+                    // stop motors if our polls stop (each poll refreshes the heartbeat)
+                    avrs[avrNum].SendCmd('c.m0 hb ' + kMotorHeartbeat + ';m1 hb ' +
+                        kMotorHeartbeat + ';m2 hb ' + kMotorHeartbeat + '\n');
                 }
                 Log(avr, 'attached (s/n', msg + ')');
             } else {
@@ -888,6 +1302,9 @@ function HandleResponse(avrNum, responseID, msg)
                             motorPos[n] = Number(a[i].substr(4));
                             break;
                     }
+                    if (a[i].substr(0,2) == "T=") {
+                        motorTime[n] = AvrTime(avrNum, a[i].substr(2));
+                    }
                 }
                 if (n==2) {
                     // log a message if any of the motors turned on or off
@@ -921,7 +1338,9 @@ function HandleResponse(avrNum, responseID, msg)
             }
         }   break;
 
-        case 'g': { // g = poll limit switches
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9': {
+            // 0-9 = poll limit switches (ID is PollTag() of the poll)
             var j = msg.indexOf('VAL=');
             if (j < 0 || msg.length - j < kNumLimit) {
                 avrs[0].SendCmd("c.halt\n");
@@ -952,13 +1371,38 @@ function HandleResponse(avrNum, responseID, msg)
                     }
                 }
             }
+            // this completes the AVR0 part of the hardware poll
+            // (a late response from an earlier poll doesn't complete this one)
+            if (avrNum == 0 && responseID == PollTag(pollSeq)) PollResponse(kPollAVR0);
         } break;
 
+        case 'h': { // h = time synchronization
+            var now = Date.now();
+            var avr = avrs[avrNum];
+            var j = msg.indexOf('T=');
+            if (j < 0 || avr.timeSent == null) break;
+            var rtt = now - avr.timeSent;
+            avr.timeSent = null;
+            // accept measurements with a round trip near the best seen so far,
+            // but relax the best each time so we recover if the link slows down
+            if (avr.timeRtt == null || rtt <= avr.timeRtt + 2) {
+                var first = (avr.timeOfs == null);
+                // assume the AVR read its clock at the midpoint of the round trip
+                avr.timeOfs = (now - rtt / 2) - Number(msg.substr(j+2)) * 1000;
+                if (avr.timeRtt == null || rtt < avr.timeRtt) avr.timeRtt = rtt;
+                if (first) Log('AVR'+avrNum, 'time synchronized (round trip', rtt, 'ms)');
+            } else {
+                avr.timeRtt += 1;
+            }
+        }   break;
+
+        case '!':   // ! = unsolicited event message from the AVR
+            Log('AVR'+avrNum, 'event:', msg);
+            break;
+
         case 'z':   // z = disable watchdog timer
             // forget about the unknown AVR
-            avrs[avrNum].interfaces[0].endpoints[0].device = avrs[avrNum];
-            avrs[avrNum].interfaces[0].endpoints[0].on('end', HandleEnd);
-            avrs[avrNum].interfaces[0].endpoints[0].stopPoll();
+            avrs[avrNum].Release();
             avrs[avrNum] = null;
             break;
 
@@ -1076,31 +1520,31 @@ function LogReadings(all)
 
 //-----------------------------------------------------------------------------
 // Add to history of measurements
-// Inputs: index/value pairs
+// Inputs: valid=flag set if current damper positions, add weights and
+//         air pressure are valid (otherwise just mark the time slot as used)
 // Returns: integer time of measurement
-function AddToHistory(i,vals)
+// Notes: The history is a ring buffer indexed by time, so slots for times
+//        without measurements are simply left stale (see HistorySlot())
+function AddToHistory(valid)
 {
     var d = new Date();
     var t = Math.ceil(d.getTime()/1000);
-    var entry;
-    if (!history.length) {
-        entry = history[0] = [];
-        historyTime = t;
-    } else {
-        // add entries up to this time if necessary
-        while (historyTime < t) {
-            ++historyTime;
-            history.unshift([]);
-            if (history.length > kPosHisLen) history.pop();
-        }
-        entry = history[0];
+    var i = (t % kHisLen) * kHisChan;
+    if (hisTime[t % kHisLen] != t) {
+        // start a new slot with no readings
+        hisTime[t % kHisLen] = t;
+        hisVals.fill(NaN, i, i + kHisChan);
+        snapshot = null;
     }
-    if (vals) {
-        // copy current damper positions into history
+    if (historyTime < t) historyTime = t;
+    if (valid) {
+        // save current values in history (last values in each second)
         for (var j=0; j<3; ++j) {
-            // (fixed to 4 decimals because these are for display only)
-            entry[j+i] = vals[j].toFixed(4);
+            hisVals[i+j]   = damperPosition[j];
+            hisVals[i+j+3] = damperAddWeight[j];
         }
+        hisVals[i+6] = adamCal[6];
+        snapshot = null;    // cached snapshot is now out of date
         // log our calculated values once per second
         if (logCalTime != t) {
             logCalTime = t;
@@ -1110,6 +1554,250 @@ function AddToHistory(i,vals)
     return t;
 }
 
+//-----------------------------------------------------------------------------
+// Get index of history values for the specified time
+// Returns: index into hisVals, or -1 if we have no history for this time
+function HistorySlot(t)
+{
+    if (t > historyTime || t <= historyTime - kHisLen || hisTime[t % kHisLen] != t) return -1;
+    return (t % kHisLen) * kHisChan;
+}
+
+//-----------------------------------------------------------------------------
+// Get a snapshot of the history
+// Inputs: t0=start time (s), num=number of seconds
+// Returns: Float32Array of num * kHisChan values (NaN where there is no history)
+function GetHistory(t0, num)
+{
+    var out = new Float32Array(num * kHisChan).fill(NaN);
+    for (var n=0; n<num; ++n) {
+        var i = HistorySlot(t0 + n);
+        if (i >= 0) out.set(hisVals.subarray(i, i + kHisChan), n * kHisChan);
+    }
+    return out;
+}
+
+//-----------------------------------------------------------------------------
+// Create a downsampled history tier
+// Inputs: secs=bucket length (s), len=number of buckets
+// Returns: tier object (vals holds min,max,mean for each of kHisChan channels
+//          in each bucket, and cnt the number of readings in each)
+function NewHisTier(secs, len)
+{
+    return {
+        secs: secs,
+        len:  len,
+        time: new Float64Array(len),    // start time of each bucket (s)
+        vals: new Float32Array(len * kHisChan * 3),
+        cnt:  new Uint32Array(len * kHisChan)
+    };
+}
+
+//-----------------------------------------------------------------------------
+// Add values to a downsampled history tier
+// Inputs: tier=history tier, t=time (s), vals=kHisChan values
+function AddToHisTier(tier, t, vals)
+{
+    var t0 = t - t % tier.secs;
+    var slot = (t0 / tier.secs) % tier.len;
+    var k = slot * kHisChan;
+    if (tier.time[slot] != t0) {
+        // start a new bucket
+        tier.time[slot] = t0;
+        tier.cnt.fill(0, k, k + kHisChan);
+        tier.vals.fill(NaN, k * 3, (k + kHisChan) * 3);
+    }
+    for (var j=0; j<kHisChan; ++j, ++k) {
+        var val = vals[j];
+        if (isNaN(val)) continue;
+        var n = ++tier.cnt[k];
+        var v = tier.vals;
+        if (n == 1) {
+            v[k*3] = v[k*3+1] = v[k*3+2] = val;
+        } else {
+            if (v[k*3]   > val) v[k*3]   = val;
+            if (v[k*3+1] < val) v[k*3+1] = val;
+            v[k*3+2] += (val - v[k*3+2]) / n;   // (running mean)
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Add the current readings to all downsampled history tiers
+// (called for every poll with valid Adam readings, not just the reported ones)
+function AddToHisTiers()
+{
+    var t = Math.ceil(Date.now()/1000);
+    for (var j=0; j<3; ++j) {
+        hisNow[j]   = damperPosition[j];
+        hisNow[j+3] = damperAddWeight[j];
+    }
+    hisNow[6] = adamCal[6];
+    for (var n=0; n<hisTiers.length; ++n) AddToHisTier(hisTiers[n], t, hisNow);
+}
+
+//-----------------------------------------------------------------------------
+// Get a snapshot of a downsampled history tier
+// Inputs: tier=history tier, t0=start time (s, rounded down to a bucket), num=number of buckets
+// Returns: Float32Array of num * kHisChan * 3 values (min,max,mean for each
+//          channel, or NaN where there is no history)
+function GetHisTier(tier, t0, num)
+{
+    var out = new Float32Array(num * kHisChan * 3).fill(NaN);
+    t0 -= t0 % tier.secs;
+    var tmin = historyTime - tier.secs * tier.len;
+    for (var n=0; n<num; ++n) {
+        var t = t0 + n * tier.secs;
+        var slot = (t / tier.secs) % tier.len;
+        if (t <= tmin || t > historyTime || tier.time[slot] != t) continue;
+        var k = slot * kHisChan * 3;
+        out.set(tier.vals.subarray(k, k + kHisChan * 3), n * kHisChan * 3);
+    }
+    return out;
+}
+
+//-----------------------------------------------------------------------------
+// Get binary snapshot of the current state for a new client
+// Returns: Buffer with the following little-endian layout:
+//           0  Uint8        kSnapshotType
+//           1  Uint8        active flag
+//           2  Uint16       number of history entries (N)
+//           4  Float32 x 3  motor speeds (steps/s)
+//          16  Float64      time of first history entry (s)
+//          24  Float32 x 3N damper positions for each second (NaN if no reading)
+// Notes: The snapshot is rebuilt only when the active state or motor speeds
+//        have changed since the last call, or after AddToHistory() has
+//        written to the history (which discards the cached snapshot)
+function GetSnapshot()
+{
+    var key = historyTime + ' ' + active + ' ' + lastSpd;
+    if (snapshot && key == snapshotKey) return snapshot;
+    var t0 = historyTime - kPosHisLen + 1;
+    var his = GetHistory(t0, kPosHisLen);
+    var buff = Buffer.alloc(24 + kPosHisLen * 12);
+    buff[0] = kSnapshotType;
+    buff[1] = active ? 1 : 0;
+    buff.writeUInt16LE(kPosHisLen, 2);
+    var spd = lastSpd.split(' ').map(Number);
+    for (var i=0; i<3; ++i) buff.writeFloatLE(spd[i] || 0, 4 + i * 4);
+    buff.writeDoubleLE(t0, 16);
+    for (var n=0, j=24; n<kPosHisLen; ++n) {
+        for (var i=0; i<3; ++i, j+=4) buff.writeFloatLE(his[n * kHisChan + i], j);
+    }
+    snapshot = buff;
+    snapshotKey = key;
+    return buff;
+}
+
+//-----------------------------------------------------------------------------
+// Send decimated history to a client (packet "H")
+// Inputs: this=client connection, str="ID CHANS T0 T1 NUM" where ID=request ID
+//         returned in the response, CHANS=comma-separated list of history
+//         channels (0-2=damper positions, 3-5=add weights, 6=air pressure),
+//         T0/T1=time range (s since 1970, or relative to now if <= 0),
+//         NUM=maximum number of points
+// Notes: Points come from the finest history tier that covers the start
+//        time, and give the min/max of all readings in their time interval.
+//        The response is streamed in chunks of up to kHisChunk points, each
+//        as "H ID MORE T STEP NCHAN MIN MAX ...", where MORE=0 for the last
+//        chunk, T=start time of the first point in this chunk (s), STEP=time
+//        interval of each point (s), followed by the MIN/MAX of each channel
+//        for each point (NaN if there is no data)
+function SendHistory(str)
+{
+    try {
+        var a = str.split(/\s+/);
+        var id = a[0];
+        var chans = (a[1] || '').split(',').map(Number);
+        var t0 = Math.floor(Number(a[2]));
+        var t1 = Math.floor(Number(a[3] || 0));
+        var points = Math.floor(Number(a[4] || kPosHisLen));
+        if (a.length < 3 || !id.length || isNaN(t0) || isNaN(t1) || !(points >= 1) ||
+            chans.some(function(c) { return !(c >= 0 && c < kHisChan) }))
+        {
+            this.Respond('Invalid history request');
+            return;
+        }
+        if (historyTime < 0) {
+            this.Respond('No history available');
+            return;
+        }
+        if (t0 <= 0) t0 += historyTime;
+        if (t1 <= 0) t1 += historyTime;
+        // limit the range to the history we keep
+        var last = hisTiers[hisTiers.length-1];
+        var tmin = historyTime - last.secs * last.len;
+        if (t0 < tmin) t0 = tmin;
+        if (t1 > historyTime) t1 = historyTime;
+        if (t1 < t0) {
+            this.Respond('Invalid history time range');
+            return;
+        }
+        if (points > kMaxHisPoints) points = kMaxHisPoints;
+
+        // use the finest tier that covers the start time (or the longest one)
+        var tier = last;
+        for (var n=0; n<hisTiers.length; ++n) {
+            if (t0 >= historyTime - hisTiers[n].secs * hisTiers[n].len) {
+                tier = hisTiers[n];
+                break;
+            }
+        }
+        // each point spans a whole number of tier buckets, starting on a
+        // multiple of the step (widen the step if aligning the start time
+        // would need more than the requested number of points)
+        var step = Math.ceil((t1 - t0 + 1) / points / tier.secs) * tier.secs;
+        for (;;) {
+            var ts = t0 - t0 % step;
+            var num = Math.floor((t1 - ts) / step) + 1;
+            if (num <= points) break;
+            step += tier.secs;
+        }
+        t0 = ts;
+        var per = step / tier.secs;     // buckets per point
+        var nch = chans.length;
+        var p = 0;
+        var self = this;
+    }
+    catch (err) {
+        Log('Error handling history request:', err.message);
+        this.Respond('Error handling history request');
+        return;
+    }
+
+    // send one chunk at a time so we don't hold up the hardware polling
+    (function SendChunk() {
+        if (conn.indexOf(self) < 0) return; // (client disconnected)
+        try {
+            var cnt = Math.min(kHisChunk, num - p);
+            var t = t0 + p * step;
+            var his = GetHisTier(tier, t, cnt * per);
+            var out = new Array(cnt * nch * 2);
+            for (var i=0, k=0; i<cnt; ++i) {
+                for (var j=0; j<nch; ++j) {
+                    var lo = Infinity, hi = -Infinity;
+                    for (var b=0; b<per; ++b) {
+                        var v = ((i * per + b) * kHisChan + chans[j]) * 3;
+                        if (his[v] < lo) lo = his[v];       // (NaN if no data, so ignored)
+                        if (his[v+1] > hi) hi = his[v+1];
+                    }
+                    if (lo > hi) lo = hi = NaN;             // (no data for this point)
+                    out[k++] = lo.toFixed(4);
+                    out[k++] = hi.toFixed(4);
+                }
+            }
+            p += cnt;
+            self.SendData('H ' + id + ' ' + (p < num ? 1 : 0) + ' ' + t + ' ' + step +
+                          ' ' + nch + ' ' + out.join(' '));
+            if (p < num) setImmediate(SendChunk);
+        }
+        catch (err) {
+            Log('Error sending history:', err.message);
+            self.Respond('Error sending history');
+        }
+    })();
+}
+
 //-----------------------------------------------------------------------------
 // Pad integer to 2 digits
 function Pad2(num)
@@ -1122,7 +1810,7 @@ function Pad2(num)
 // Clean up before program termination
 function Cleanup()
 {
-    clearInterval(intrvl);  // stop our polling
+    clearTimeout(pollTimer);    // stop our polling
 
     for (var i=0; i<avrs.length; ++i) {
         if (!avrs[i]) continue;
@@ -1131,13 +1819,13 @@ function Cleanup()
         if (i < 2) --foundAVRs;
         // release any still-open interfaces
         try {
-            avri.interfaces[0].release(true, function(error) { });
-            avri.close();
+            avri.Close();
         }
         catch (err) {
         }
     }
     CloseAdam();
+    archive.Close();
 }
 
 //-----------------------------------------------------------------------------